@@ -0,0 +1,169 @@
+#pragma once
+
+#include "libbpcs.h"
+#include <cstdlib> // for realloc, free
+#include <cstring> // for memcpy
+#include <vector>
+#ifdef HUGE_PAGES
+# include <sys/mman.h> // for madvise
+#endif
+
+
+/*
+ * Every buffer that the library allocates is allocated with a bpcs_allocator, so that its users can supply their own
+ * The programs use default_allocator, and the daemon's workers each use a Pool.
+ */
+
+
+namespace alloc {
+
+
+inline
+void* default_realloc(void*,  void* const ptr,  const size_t sz){
+	return ::realloc(ptr, sz);
+}
+
+inline
+void default_free(void*,  void* const ptr){
+	::free(ptr);
+}
+
+constexpr static
+const bpcs_allocator default_allocator = {default_realloc,  default_free,  nullptr};
+
+
+inline
+void* malloc(const bpcs_allocator* const allocator,  const size_t sz){
+	return allocator->realloc_fn(allocator->ctx,  nullptr,  sz);
+}
+
+inline
+void* realloc(const bpcs_allocator* const allocator,  void* const ptr,  const size_t sz){
+	return allocator->realloc_fn(allocator->ctx,  ptr,  sz);
+}
+
+inline
+void free(const bpcs_allocator* const allocator,  void* const ptr){
+	if (ptr != nullptr)
+		allocator->free_fn(allocator->ctx,  ptr);
+}
+
+
+#ifdef HUGE_PAGES
+constexpr static size_t huge_page_sz = 2 * 1024 * 1024; // Of transparent huge pages on x86-64
+
+inline
+void* advise_huge_pages(void* const block,  const size_t sz){
+	// Asks the kernel to back sz bytes of block with huge pages, where sz is a multiple of huge_page_sz and block has room for huge_page_sz more bytes than that. Returns the start of those bytes, which is the first huge page boundary in block.
+	void* const begin = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(block) + huge_page_sz - 1)  &  ~(huge_page_sz - 1));
+	// Fails harmlessly if they are disabled
+	madvise(begin, sz, MADV_HUGEPAGE);
+	return begin;
+}
+#endif
+
+
+struct Deleter {
+	// For std::unique_ptr, so that buffers are freed if handler() throws
+	const bpcs_allocator* allocator;
+
+	void operator()(void* const ptr) const {
+		free(this->allocator, ptr);
+	}
+};
+
+
+class Pool {
+	/*
+	 * Keeps the large blocks that are freed, and reuses them for later allocations that fit, so that a thread that runs job after job reuses the buffers of the jobs before
+	 * Not thread-safe, so each thread has its own
+	 */
+  public:
+	Pool()
+	: allocator{realloc_fn,  free_fn,  this}
+	{
+		// So that freeing never allocates
+		this->blocks.reserve(max_n_blocks + 1);
+	}
+	
+	Pool(const Pool&) = delete;
+	Pool& operator=(const Pool&) = delete;
+	
+	~Pool(){
+		for (Header* const block : this->blocks)
+			::free(block);
+	}
+	
+	const bpcs_allocator allocator;
+	
+  private:
+	struct alignas(16) Header {
+		// Precedes each block, so that it stays as aligned as malloc's
+		size_t capacity;
+	};
+	
+	constexpr static size_t min_pooled_sz = 64 * 1024; // Smaller blocks are left to malloc, which is quick enough for them
+	constexpr static size_t max_n_blocks = 16;
+	
+	std::vector<Header*> blocks;
+	
+	static
+	void* realloc_fn(void* const ctx,  void* const ptr,  const size_t sz){
+		Pool* const pool = reinterpret_cast<Pool*>(ctx);
+		if (ptr != nullptr){
+			const Header* const header = reinterpret_cast<Header*>(ptr) - 1;
+			if (sz <= header->capacity)
+				return ptr;
+			void* const new_ptr = realloc_fn(ctx, nullptr, sz);
+			if (new_ptr != nullptr){
+				memcpy(new_ptr,  ptr,  header->capacity);
+				free_fn(ctx, ptr);
+			}
+			return new_ptr;
+		}
+		
+		// Reuse the smallest block that fits, unless it is more than twice the size needed
+		size_t best = pool->blocks.size();
+		for (size_t i = 0;  i < pool->blocks.size();  ++i){
+			const size_t capacity = pool->blocks[i]->capacity;
+			if ((capacity >= sz)  and  (capacity / 2 <= sz)  and  ((best == pool->blocks.size())  or  (capacity < pool->blocks[best]->capacity)))
+				best = i;
+		}
+		if (best != pool->blocks.size()){
+			Header* const header = pool->blocks[best];
+			pool->blocks[best] = pool->blocks.back();
+			pool->blocks.pop_back();
+			return header + 1;
+		}
+		
+		Header* const header = reinterpret_cast<Header*>(::malloc(sizeof(Header) + sz));
+		if (header == nullptr)
+			return nullptr;
+		header->capacity = sz;
+		return header + 1;
+	}
+	
+	static
+	void free_fn(void* const ctx,  void* const ptr){
+		Pool* const pool = reinterpret_cast<Pool*>(ctx);
+		Header* const header = reinterpret_cast<Header*>(ptr) - 1;
+		if (header->capacity < min_pooled_sz){
+			::free(header);
+			return;
+		}
+		pool->blocks.push_back(header);
+		if (pool->blocks.size() > max_n_blocks){
+			// Drop the smallest, as the largest are the most costly to allocate again
+			size_t smallest = 0;
+			for (size_t i = 1;  i < pool->blocks.size();  ++i)
+				if (pool->blocks[i]->capacity < pool->blocks[smallest]->capacity)
+					smallest = i;
+			::free(pool->blocks[smallest]);
+			pool->blocks[smallest] = pool->blocks.back();
+			pool->blocks.pop_back();
+		}
+	}
+};
+
+
+} // namespace alloc
@@ -0,0 +1,311 @@
+#include "band.hpp"
+#include "errors.hpp"
+#ifdef EMBEDDOR
+# include "utils.hpp" // for format_out_fp
+#endif
+#ifdef STATS
+# include "stats.hpp"
+#endif
+#ifdef TRACING
+# include "trace.hpp"
+#endif
+#include <compsky/macros/likely.hpp>
+#include <algorithm> // for std::min
+
+
+template<class G>
+BandStreamBuf<G>::~BandStreamBuf(){
+	alloc::free(&alloc::default_allocator, this->buffers);
+}
+
+template<class G>
+void BandStreamBuf<G>::open_img(){
+  #ifdef STATS
+	const stats::Timer timer(stats::DECODE);
+  #endif
+  #ifdef CHITTY_CHATTY
+	fprintf(stderr,  "Loading image: %s\n",  this->img_fps[this->img_n]);
+  #endif
+	this->reader.open(this->img_fps[this->img_n], &alloc::default_allocator);
+  #ifdef STATS
+	stats::add_file_sz(stats::PNG_BYTES_IN, this->img_fps[this->img_n]);
+  #endif
+	this->n_bitplanes = this->reader.n_bitplanes;
+	this->n_rows_read = 0;
+	this->n_grids_hrztl = this->reader.w / G::w;
+
+	// Only a band is held at once, so reallocating for each image costs little
+	// The scratch space comes first, as it must be aligned to 8 bytes
+	const size_t kernel_scratch_sz = byteplane::get_scratch_sz<G>(this->reader.w);
+	const size_t grid_complexities_sz = N_CHANNELS * size_t(this->n_bitplanes) * this->n_grids_hrztl * sizeof(complexity_typ);
+	const size_t rows_sz = this->reader.row_sz * G::h;
+	const size_t byteplane_sz = size_t(this->reader.w) * G::h;
+	alloc::free(&alloc::default_allocator, this->buffers);
+	this->buffers = alloc::malloc(&alloc::default_allocator,  kernel_scratch_sz + grid_complexities_sz + rows_sz + N_CHANNELS * byteplane_sz);
+	if (unlikely(this->buffers == nullptr))
+		handler(OOM);
+	this->kernel_scratch = this->buffers;
+	this->grid_complexities = (complexity_typ*)((uchar*)this->buffers + kernel_scratch_sz);
+	this->rows = (uchar*)this->grid_complexities + grid_complexities_sz;
+	for (auto k = 0;  k < N_CHANNELS;  ++k)
+		this->channel_byteplanes[k] = this->rows + rows_sz + k * byteplane_sz;
+}
+
+template<class G>
+size_t BandStreamBuf<G>::get_n_cgc(const unsigned j) const {
+	const size_t n_cgc = size_t(this->reader.w) * this->reader.h;
+	const size_t row_start = N_CHANNELS * size_t(this->reader.w) * (this->n_rows_read - G::h + j);
+	if (row_start >= n_cgc)
+		return 0;
+	return std::min<size_t>(n_cgc - row_start,  N_CHANNELS * size_t(this->reader.w));
+}
+
+template<class G>
+bool BandStreamBuf<G>::load_next_band(){
+	if (this->reader.h - this->n_rows_read < G::h)
+		// The rows after the last whole band hold no grids
+		return false;
+	const uint32_t w = this->reader.w;
+	{
+	  #ifdef STATS
+		const stats::Timer timer(stats::DECODE);
+	  #endif
+		for (unsigned j = 0;  j < G::h;  ++j)
+			this->reader.read_row(this->rows + j * this->reader.row_sz);
+		this->n_rows_read += G::h;
+	}
+	{
+	  #ifdef STATS
+		const stats::Timer timer(stats::SPLIT);
+	  #endif
+		// As in BPCSStreamBuf::split_channels, only the first w*h elements of the image are converted to CGC
+		for (unsigned j = 0;  j < G::h;  ++j){
+			const uchar* const row = this->rows + j * this->reader.row_sz;
+			uchar* row_byteplanes[N_CHANNELS];
+			for (auto k = 0;  k < N_CHANNELS;  ++k)
+				row_byteplanes[k] = this->channel_byteplanes[k] + j * size_t(w);
+			const size_t n_cgc = this->get_n_cgc(j);
+			const size_t n_cgc_px = n_cgc / N_CHANNELS; // Pixels of the row whose elements are all converted
+			split_channels_range<true>(row,  row_byteplanes,  0,  n_cgc_px);
+			if (n_cgc_px == w)
+				continue;
+			for (auto k = 0;  k < N_CHANNELS;  ++k){
+				// The pixel on the boundary
+				const size_t px_indx = N_CHANNELS*n_cgc_px + k;
+				row_byteplanes[k][n_cgc_px] = (px_indx < n_cgc) ? to_cgc(row[px_indx]) : row[px_indx];
+			}
+			split_channels_range<false>(row,  row_byteplanes,  n_cgc_px + 1,  w);
+		}
+	}
+	{
+	  #ifdef STATS
+		const stats::Timer timer(stats::COMPLEXITIES);
+	  #endif
+		for (auto k = 0;  k < N_CHANNELS;  ++k)
+			byteplane::get_grid_complexities<G>(this->channel_byteplanes[k], w, G::h, this->n_bitplanes, this->grid_complexities + k * this->n_bitplanes * this->n_grids_hrztl, this->kernel_scratch);
+	}
+	this->bitplane_indx = 0;
+	this->grid_n = 0;
+	return true;
+}
+
+template<class G>
+void BandStreamBuf<G>::load_next_img(){
+	if (unlikely(this->img_n == this->n_imgs))
+		handler(TOO_MUCH_DATA_TO_ENCODE);
+  #ifdef TRACING
+	const trace::Span span("load_next_img", trace::Args{this->img_fps[this->img_n]});
+  #endif
+	this->open_img();
+  #ifdef EMBEDDOR
+	if (this->embedding){
+		// The output image is written as the bands are finished with
+		format_out_fp(this->out_fmt, this->img_fps[this->img_n], this->out_fp);
+		this->writer.open(this->out_fp, (this->reader.has_png_bg) ? &this->reader.png_bg : nullptr, this->reader.w, this->reader.h, this->n_bitplanes, this->write_policy, &alloc::default_allocator);
+		this->n_rows_written = 0;
+	}
+  #endif
+
+	// As if the band before the first had been walked
+	this->bitplane_indx = N_CHANNELS * this->n_bitplanes;
+	this->set_next_grid();
+
+  #ifdef EMBEDDOR
+	if (!this->embedding)
+  #endif
+	if (this->img_n == this->img_n_offset){
+		// If false, this function is being called from within get()
+		if (this->grid[G::conjugation_bit_indx])
+			conjugate<G>(this->grid);
+	}
+}
+
+template<class G>
+void BandStreamBuf<G>::set_next_grid(){
+	do {
+		for (;  this->bitplane_indx != N_CHANNELS * this->n_bitplanes;  ++this->bitplane_indx,  this->grid_n = 0){
+			const complexity_typ* const complexities = this->grid_complexities + this->bitplane_indx * this->n_grids_hrztl;
+			for (;  this->grid_n != this->n_grids_hrztl;  ++this->grid_n){
+				if (complexities[this->grid_n] < this->min_complexity)
+					continue;
+			  #ifdef EMBEDDOR
+				// When embedding, the grid is about to be overwritten
+				if (!this->embedding)
+			  #endif
+				{
+					const unsigned bit_n = this->bitplane_indx % this->n_bitplanes;
+					const uchar* itr = this->channel_byteplanes[this->bitplane_indx / this->n_bitplanes]  +  this->grid_n * G::w;
+					for (unsigned j = 0;  j < G::h;  ++j){
+						for (unsigned i = 0;  i < G::w;  ++i)
+							this->grid[G::w*j + i] = (itr[i] >> bit_n) & 1;
+						itr += this->reader.w;
+					}
+				}
+				++this->grid_n;
+				return;
+			}
+		}
+
+		// If we are here, we have exhausted the band
+	  #ifdef EMBEDDOR
+		if (this->embedding)
+			this->write_band();
+	  #endif
+	} while (this->load_next_band());
+
+	// If we are here, we have exhausted the image
+	if (this->img_n + 1 < this->n_imgs){
+	  #ifdef EMBEDDOR
+		if (this->embedding)
+			this->save_im();
+	  #endif
+		++this->img_n;
+		this->load_next_img();
+		return;
+	}
+
+  #ifdef EMBEDDOR
+	if (this->embedding)
+		handler(TOO_MUCH_DATA_TO_ENCODE);
+  #endif
+	this->exhausted = true;
+}
+
+template<class G>
+void BandStreamBuf<G>::get(uchar* msg_arr){
+	grid_to_bytes<G>(this->grid, msg_arr);
+
+	this->set_next_grid();
+
+	if (this->grid[G::conjugation_bit_indx] != 0)
+		conjugate<G>(this->grid);
+}
+
+#ifdef ONLY_COUNT
+template<class G>
+void BandStreamBuf<G>::add_to_histogram(const int n,  uint64_t* histogram){
+	this->img_n = n;
+	this->open_img();
+	while (this->load_next_band()){
+		const complexity_typ* itr = this->grid_complexities;
+		for (auto k = 0;  k < N_CHANNELS;  ++k){
+			for (auto b = 0;  b < this->n_bitplanes;  ++b){
+				uint64_t* const counts = histogram  +  (k * MAX_BITPLANES + b) * (G::max_complexity + 1);
+				for (size_t i = 0;  i < this->n_grids_hrztl;  ++i)
+					++counts[*(itr++)];
+			}
+		}
+	}
+	this->reader.close();
+}
+#endif
+
+#ifdef EMBEDDOR
+template<class G>
+void BandStreamBuf<G>::embed_grid(){
+	const unsigned bit_n = this->bitplane_indx % this->n_bitplanes;
+	uchar* itr = this->channel_byteplanes[this->bitplane_indx / this->n_bitplanes]  +  (this->grid_n - 1) * G::w;
+	for (unsigned j = 0;  j < G::h;  ++j){
+		for (unsigned i = 0;  i < G::w;  ++i)
+			itr[i] = (itr[i] & ~(1 << bit_n))  |  (this->grid[G::w*j + i] << bit_n);
+		itr += this->reader.w;
+	}
+}
+
+template<class G>
+MULTIVERSIONED
+void BandStreamBuf<G>::write_band(){
+	if (this->n_rows_written == this->n_rows_read)
+		return;
+	const uint32_t w = this->reader.w;
+	{
+	  #ifdef STATS
+		const stats::Timer timer(stats::MERGE);
+	  #endif
+		for (unsigned j = 0;  j < G::h;  ++j){
+			uchar* const row = this->rows + j * this->reader.row_sz;
+			const size_t offset = j * size_t(w);
+			const size_t n_cgc = this->get_n_cgc(j);
+			for (uint32_t i = 0;  i < w;  ++i)
+				for (auto k = 0;  k < N_CHANNELS;  ++k){
+					// See the note in load_next_band
+					const uchar val = this->channel_byteplanes[k][offset + i];
+					row[N_CHANNELS*i + k] = (N_CHANNELS*i + k < n_cgc) ? from_cgc[val] : val;
+				}
+		}
+	}
+	{
+	  #ifdef STATS
+		const stats::Timer timer(stats::ENCODE);
+	  #endif
+		for (unsigned j = 0;  j < G::h;  ++j)
+			this->writer.write_row(this->rows + j * this->reader.row_sz);
+	}
+	this->n_rows_written = this->n_rows_read;
+}
+
+template<class G>
+void BandStreamBuf<G>::put(uchar* in){
+	for (uint_fast8_t j=0; j<G::n_bytes; ++j){
+		for (uint_fast8_t i=0; i<8; ++i){
+			this->grid[8*j +i] = in[j] & 1;
+			in[j] = in[j] >> 1;
+		}
+	}
+
+	this->grid[G::conjugation_bit_indx] = 0;
+
+	if (get_grid_complexity<G>(this->grid) < this->min_complexity)
+		conjugate<G>(this->grid);
+
+	this->embed_grid();
+	this->set_next_grid();
+}
+
+template<class G>
+void BandStreamBuf<G>::save_im(){
+  #ifdef STATS
+	const stats::Timer timer(stats::ENCODE);
+  #endif
+  #ifdef TRACING
+	const trace::Span span("save_im", trace::Args{this->img_fps[this->img_n]});
+  #endif
+	this->write_band();
+	// The rows after the current band are copied unchanged
+	for (;  this->n_rows_read != this->reader.h;  ++this->n_rows_read){
+		this->reader.read_row(this->rows);
+		this->writer.write_row(this->rows);
+	}
+	this->writer.close();
+	this->reader.close();
+  #ifdef STATS
+	stats::add_file_sz(stats::PNG_BYTES_OUT, this->out_fp);
+  #endif
+}
+#endif
+
+
+#define INSTANTIATE(N) \
+	template class BandStreamBuf<Grid<N, N>>;
+FOR_EACH_GRID_SIZE(INSTANTIATE)
+#undef INSTANTIATE
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "bpcs.hpp" // for split_channels_range
+#include "byteplane.hpp"
+
+
+/*
+ * Vessel images processed a band of G::h rows at a time, for images too large to be held in memory
+ * Each band is decoded, split into byteplanes, walked, and (when embedding) merged back into its pixels and encoded before the next band is decoded, so memory is bounded by the width of the images rather than their size.
+ * The stream is laid out band by band (every grid of every bitplane of the first band, then of the second, and so on) rather than bitplane by bitplane, so it can only be extracted in bands.
+ */
+
+
+template<class G>
+class BandStreamBuf {
+	// Has the interface of BPCSStreamBuf that extracting and embedding use
+  public:
+	BandStreamBuf(const unsigned min_complexity,  int img_n,  int n_imgs,  char** im_fps
+	            #ifdef EMBEDDOR
+	              , bool emb
+	              , char* outfmt
+	            #endif
+	            )
+	: exhausted(false)
+  #ifdef EMBEDDOR
+	, embedding(emb)
+	, out_fmt(outfmt)
+  #endif
+	, img_n_offset(img_n)
+	, n_imgs(n_imgs)
+	, min_complexity(min_complexity)
+	, img_n(img_n)
+	, img_fps(im_fps)
+	, buffers(nullptr)
+	{}
+
+	~BandStreamBuf();
+
+	bool exhausted;
+
+  #ifdef EMBEDDOR
+	const bool embedding;
+	char* out_fmt;
+	png::WritePolicy write_policy; // Only the level and filter are used, as the rows are encoded by the PNG library
+  #endif
+
+	int n_bitplanes; // Of the current image
+	const int img_n_offset;
+	const int n_imgs;
+
+	void load_next_img(); // Init
+	void get(uchar* msg_arr);
+  #ifdef EMBEDDOR
+	void put(uchar arr[G::n_bytes]);
+	void save_im(); // End
+  #endif
+  #ifdef ONLY_COUNT
+	void add_to_histogram(const int n,  uint64_t* histogram); // Adds the grids of the nth image to histogram, as BPCSStreamBuf::add_to_histogram does for the current image
+  #endif
+  private:
+	typedef typename G::complexity_typ complexity_typ;
+
+	const unsigned min_complexity;
+	int img_n;
+	char** img_fps;
+
+	png::RowReader reader; // Of the current image
+	uint32_t n_rows_read; // The last G::h of which are the current band
+  #ifdef EMBEDDOR
+	png::RowWriter writer;
+	uint32_t n_rows_written;
+	char out_fp[MAX_FILE_PATH_LEN];
+  #endif
+
+	void* buffers; // The block that the buffers of the band are carved from, sized for the width of the current image
+	complexity_typ* grid_complexities; // The complexity of every grid of every bitplane of every channel of the band, as tables of n_grids_hrztl elements
+	uchar* rows; // The pixels of the band, as decoded
+	uchar* channel_byteplanes[N_CHANNELS]; // Of the band
+	void* kernel_scratch; // Of byteplane::get_grid_complexities
+	size_t n_grids_hrztl;
+
+	int bitplane_indx; // Of the current bitplane, indexed as (channel_n * n_bitplanes + bitplane_n)
+	size_t grid_n; // Index of the next grid of the current bitplane to consider
+	uchar grid[G::sz];
+
+	void open_img(); // Reads the header of the current image, and allocates the buffers for its width
+	size_t get_n_cgc(const unsigned j) const; // Number of elements of the jth row of the current band that are converted to CGC
+	bool load_next_band(); // Decodes the next band, splits it into byteplanes and calculates its complexities. Returns false if the image has no more whole bands.
+	void set_next_grid();
+  #ifdef EMBEDDOR
+	void embed_grid(); // Writes the current grid to its byteplane
+	MULTIVERSIONED
+	void write_band(); // Merges the byteplanes of the band back into its pixels, and encodes them, unless it has already been written
+  #endif
+};
@@ -0,0 +1,485 @@
+#include "bpcs.hpp"
+#include "grid.hpp"
+#include "png.hpp"
+#include "synth.hpp"
+#include "errors.hpp"
+#include "cpu.hpp"
+#include "json.hpp"
+#include <compsky/macros/likely.hpp>
+#define LIBCOMPSKY_NO_TESTS
+#include <compsky/deasciify/a2n.hpp>
+#include <algorithm> // for std::sort
+#include <chrono>
+#include <cstdio>
+#include <cstdlib> // for mkdtemp, getenv
+#include <cstring> // for memcpy
+#include <string>
+#include <vector>
+#include <unistd.h> // for unlink, rmdir
+
+
+/*
+ * bpcs-bench - times each stage of the stream, and whole embeds, extracts and counts, on synthetic vessel images (see synth.hpp), and writes the results as JSON
+ * It is built with the same options as bpcs, so that the effect of a compiler, MALLOC_OVERRIDE, GRID_SIZE, etc. can be measured by comparing the results of two builds.
+ *
+ * Usage: bpcs-bench [-o results.json] [-l label] [-w width] [-h height] [-n n_imgs] [-s seed] [-d weights] [-t threshold] [-r n_reps]
+ *        bpcs-bench -g dir [-w width] [-h height] [-n n_imgs] [-s seed] [-d weights]
+ *            Only writes the synthetic vessel images to dir/v0.png, dir/v1.png ... for benchmarking the programs themselves
+ */
+
+
+#if defined(COMPLEXITY_ENGINE_BYTEPLANE)
+# define COMPLEXITY_ENGINE_NAME "byteplane"
+#elif defined(COMPLEXITY_ENGINE_PACKED)
+# define COMPLEXITY_ENGINE_NAME "packed"
+#else
+# define COMPLEXITY_ENGINE_NAME "scalar"
+#endif
+
+
+static volatile unsigned sink; // So that results which are otherwise unused are not optimised out
+
+
+struct Result {
+	const char* name;
+	const char* unit; // Of n
+	uint64_t n; // Number of units processed by each repetition
+	std::vector<uint64_t> ns; // Duration of each repetition
+};
+
+
+template<typename Setup,  typename Fn>
+Result measure(const char* const name,  const char* const unit,  const unsigned n_reps,  Setup setup,  Fn fn){
+	// setup() is not timed. fn() returns the number of units it processed.
+	// An extra repetition is run first, and not counted, to warm the caches.
+	Result result{name, unit, 0, {}};
+	for (unsigned rep = 0;  rep <= n_reps;  ++rep){
+		setup();
+		const auto start = std::chrono::steady_clock::now();
+		result.n = fn();
+		const auto end = std::chrono::steady_clock::now();
+		if (rep != 0)
+			result.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+	}
+	return result;
+}
+
+template<typename Fn>
+Result measure(const char* const name,  const char* const unit,  const unsigned n_reps,  Fn fn){
+	return measure(name, unit, n_reps, [](){}, fn);
+}
+
+
+class Bench {
+	// The private stages of the stream, which it is a friend of
+  public:
+	static
+	void rewind(BPCSStreamBuf<DefaultGrid>& s){
+		// Returns an extracting stream of a single image to its first grid
+		s.exhausted = false;
+		s.img_n = 0;
+		s.load_next_img();
+	}
+
+	static
+	uint64_t walk(BPCSStreamBuf<DefaultGrid>& s){
+		// Finds every remaining complex grid of the stream, without extracting them
+		uint64_t n = 0;
+		while (true){
+			s.set_next_grid();
+			if (s.exhausted)
+				return n;
+			++n;
+		}
+	}
+
+	static
+	uint64_t get_all(BPCSStreamBuf<DefaultGrid>& s,  uchar* out){
+		// As extract_to_stdout
+		uint64_t n = 0;
+		do {
+			s.get(out + n);
+			n += DefaultGrid::n_bytes;
+		} while (not s.exhausted);
+		return n;
+	}
+
+	static
+	uint64_t put_all(BPCSStreamBuf<DefaultGrid>& s,  const uchar* data,  const uint64_t n_bytes){
+		// As embed_from_stdin, without writing the image
+		uchar grid_bytes[DefaultGrid::n_bytes]; // put() modifies the bytes it is given
+		uint64_t n = 0;
+		for (;  (n + DefaultGrid::n_bytes <= n_bytes)  and  (not s.exhausted);  n += DefaultGrid::n_bytes){
+			memcpy(grid_bytes,  data + n,  DefaultGrid::n_bytes);
+			s.put(grid_bytes);
+		}
+		return n;
+	}
+
+	static
+	uint64_t split_channels(BPCSStreamBuf<DefaultGrid>& s){
+		s.split_channels();
+		return N_CHANNELS * s.w * s.h;
+	}
+
+	static
+	uint64_t calc_complexities(BPCSStreamBuf<DefaultGrid>& s){
+		// The complexity engine's pass over a whole image. Returns 0 if the engine calculates them one grid at a time, as the scalar engine does.
+	  #if defined(COMPLEXITY_ENGINE_BYTEPLANE)
+		s.calc_grid_complexities();
+	  #elif defined(COMPLEXITY_ENGINE_PACKED)
+		for (auto k = 0;  k < N_CHANNELS;  ++k)
+			for (auto n = 0;  n < s.n_bitplanes;  ++n)
+				s.scan_bitplane(s.channel_byteplanes[k], n);
+	  #else
+		return 0;
+	  #endif
+		return N_CHANNELS  *  s.n_bitplanes  *  (s.w / DefaultGrid::w) * (s.h / DefaultGrid::h);
+	}
+
+	static
+	void dirty_every_grid(BPCSStreamBuf<DefaultGrid>& s){
+		// Splits out every bitplane of an embedding stream, and marks every grid as embedded in, so that write_back_dirty_grids merges the whole image back into its pixels
+		const int n_planes = N_CHANNELS * s.n_bitplanes;
+		for (s.bitplane_n = 0;  s.bitplane_n < n_planes;  ++s.bitplane_n)
+			s.split_bitplane();
+		s.bitplane_n = n_planes - 1;
+		memset(s.dirty_grids,  0,  packed::get_bitmap_sz(s.n_grids) * sizeof(uint64_t));
+		for (size_t i = 0;  i < s.n_grids;  ++i)
+			s.dirty_grids[i / 64] |= uint64_t(1) << (i % 64);
+	}
+
+	static
+	uint64_t merge_channels(BPCSStreamBuf<DefaultGrid>& s){
+		s.write_back_dirty_grids();
+		return N_CHANNELS * s.w * s.h;
+	}
+
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	static
+	uint64_t count(BPCSStreamBuf<DefaultGrid>& s){
+		// As bpcs-count
+		uint64_t n = 0;
+		for (int img_n = 0;  img_n != s.n_imgs;  ++img_n){
+			s.decode_img(img_n);
+			for (int i = 0;  i < N_CHANNELS * s.n_bitplanes;  ++i)
+				n += s.count_complex_grids(i) * DefaultGrid::n_bytes;
+		}
+		return n;
+	}
+  #endif
+};
+
+
+static
+void print_bool(FILE* const f,  const char* const name,  const bool val){
+	fprintf(f,  ",\n\t\t\"%s\": %s",  name,  (val) ? "true" : "false");
+}
+
+
+int main(const int argc,  char* argv[]){
+	synth::VesselSpec spec;
+	int n_imgs = 4;
+	unsigned min_complexity = 50;
+	unsigned n_reps = 5;
+	const char* out_fp = nullptr;
+	const char* label = "";
+	const char* gen_dir = nullptr;
+	for (int i = 1;  i < argc;  ++i){
+		const char* const arg = argv[i];
+		if (unlikely((arg[0] != '-')  or  (arg[1] == 0)  or  (arg[2] != 0)  or  (i + 1 == argc)))
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+		const char* const val = argv[++i];
+		switch(arg[1]){
+			case 'o': out_fp = val; break;
+			case 'l': label = val; break;
+			case 'g': gen_dir = val; break;
+			case 'w': spec.w = a2n<uint32_t>(val); break;
+			case 'h': spec.h = a2n<uint32_t>(val); break;
+			case 'n': n_imgs = a2n<int>(val); break;
+			case 's': spec.seed = a2n<uint64_t>(val); break;
+			case 't': min_complexity = a2n<unsigned>(val); break;
+			case 'r': n_reps = a2n<unsigned>(val); break;
+			case 'd':
+				if (unlikely(not synth::parse_weights(val, spec.weights)))
+					handler(WRONG_ARGUMENTS_TO_PROGRAM);
+				break;
+			default:
+				handler(WRONG_ARGUMENTS_TO_PROGRAM);
+		}
+	}
+	if (unlikely((spec.w < DefaultGrid::w)  or  (spec.h < DefaultGrid::h)  or  (n_imgs < 1)  or  (n_reps == 0)))
+		handler(WRONG_ARGUMENTS_TO_PROGRAM);
+
+	// The vessels are written as PNG files, as the stream only reads files
+	std::string dir;
+	if (gen_dir != nullptr)
+		dir = gen_dir;
+	else {
+		const char* const tmp_dir = getenv("TMPDIR");
+		dir = std::string((tmp_dir != nullptr) ? tmp_dir : "/tmp")  +  "/bpcs-bench.XXXXXX";
+		if (unlikely(mkdtemp(&dir[0]) == nullptr))
+			handler(CANNOT_CREATE_FILE);
+	}
+	const size_t img_sz = N_CHANNELS * size_t(spec.w) * spec.h;
+	std::vector<uchar> pixels(img_sz);
+	std::vector<std::string> vessel_fps;
+	std::vector<std::string> out_fps;
+	const png::WritePolicy write_policy;
+	for (int img_n = 0;  img_n < n_imgs;  ++img_n){
+		vessel_fps.push_back(dir + "/v" + std::to_string(img_n) + ".png");
+		out_fps.push_back(dir + "/v" + std::to_string(img_n) + ".out.png");
+		synth::generate(spec, img_n, pixels.data());
+		png::write(vessel_fps.back().c_str(), nullptr, pixels.data(), spec.w, spec.h, 8, write_policy, &alloc::default_allocator);
+	}
+	if (gen_dir != nullptr)
+		return 0;
+	std::vector<char*> vessel_fps_c;
+	std::vector<char*> out_fps_c;
+	for (int img_n = 0;  img_n < n_imgs;  ++img_n){
+		vessel_fps_c.push_back(&vessel_fps[img_n][0]);
+		out_fps_c.push_back(&out_fps[img_n][0]);
+	}
+	std::string out_fmt = dir + "/{basename}.out.png";
+
+	std::vector<Result> results;
+
+	/* PNG */
+	{
+		const size_t img_data_sz = png::get_img_data_sz(spec.w, spec.h);
+		uchar* const img_data = (uchar*)alloc::malloc(&alloc::default_allocator, img_data_sz);
+		uint32_t w;
+		uint32_t h;
+		int n_bitplanes;
+		png_color_16 png_bg;
+		bool has_png_bg;
+		results.push_back(measure("png_read", "bytes", n_reps, [&](){
+			png::read(vessel_fps_c[0], img_data, img_data_sz, &alloc::default_allocator, w, h, n_bitplanes, png_bg, has_png_bg);
+			return img_sz;
+		}));
+		alloc::free(&alloc::default_allocator, img_data);
+		synth::generate(spec, 0, pixels.data());
+		results.push_back(measure("png_write", "bytes", n_reps, [&](){
+			png::write(out_fps_c[0], nullptr, pixels.data(), spec.w, spec.h, 8, write_policy, &alloc::default_allocator);
+			return img_sz;
+		}));
+	}
+
+	/* Grids */
+	{
+		std::vector<uchar> cgc(img_sz);
+		results.push_back(measure("to_cgc", "bytes", n_reps, [&](){
+			for (size_t i = 0;  i < img_sz;  ++i)
+				cgc[i] = to_cgc(pixels[i]);
+			sink = cgc[img_sz - 1];
+			return img_sz;
+		}));
+		results.push_back(measure("from_cgc", "bytes", n_reps, [&](){
+			for (size_t i = 0;  i < img_sz;  ++i)
+				pixels[i] = from_cgc[cgc[i]];
+			sink = pixels[img_sz - 1];
+			return img_sz;
+		}));
+
+		// Every grid of every bitplane of the first channel, laid out one after another
+		const uint32_t n_grids_hrztl = spec.w / DefaultGrid::w;
+		const uint32_t n_grids = n_grids_hrztl * (spec.h / DefaultGrid::h);
+		std::vector<uchar> grids(8 * size_t(n_grids) * DefaultGrid::sz);
+		uchar* itr = grids.data();
+		for (unsigned bit_n = 0;  bit_n < 8;  ++bit_n)
+			for (uint32_t i = 0;  i < n_grids;  ++i)
+				for (unsigned j = 0;  j < DefaultGrid::h;  ++j)
+					for (unsigned k = 0;  k < DefaultGrid::w;  ++k){
+						const size_t px_indx = ((i / n_grids_hrztl) * DefaultGrid::h + j) * spec.w  +  (i % n_grids_hrztl) * DefaultGrid::w + k;
+						*(itr++) = (cgc[N_CHANNELS * px_indx] >> bit_n) & 1;
+					}
+		results.push_back(measure("get_grid_complexity", "grids", n_reps, [&](){
+			unsigned sum = 0;
+			for (const uchar* grid = grids.data();  grid != grids.data() + grids.size();  grid += DefaultGrid::sz)
+				sum += get_grid_complexity<DefaultGrid>(grid);
+			sink = sum;
+			return 8 * uint64_t(n_grids);
+		}));
+	}
+
+	/* Stages of the stream, on the first image */
+	uint64_t capacity;
+	{
+		BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, 1, vessel_fps_c.data(), false, nullptr);
+		bpcs_stream.decode_img(0);
+		results.push_back(measure("split_channels", "bytes", n_reps, [&](){
+			return Bench::split_channels(bpcs_stream);
+		}));
+		const Result engine = measure("calc_complexities", "grids", n_reps, [&](){
+			return Bench::calc_complexities(bpcs_stream);
+		});
+		if (engine.n != 0)
+			results.push_back(engine);
+		results.push_back(measure("set_next_grid", "grids", n_reps, [&](){
+			Bench::rewind(bpcs_stream);
+		}, [&](){
+			return Bench::walk(bpcs_stream);
+		}));
+		std::vector<uchar> out((1 + results.back().n) * DefaultGrid::n_bytes);
+		results.push_back(measure("get", "bytes", n_reps, [&](){
+			Bench::rewind(bpcs_stream);
+		}, [&](){
+			return Bench::get_all(bpcs_stream, out.data());
+		}));
+		capacity = results.back().n;
+	}
+	{
+		std::vector<uchar> data(capacity);
+		synth::Rng{spec.seed}.fill(data.data(), capacity);
+		BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, 1, vessel_fps_c.data(), true, &out_fmt[0]);
+		bpcs_stream.exhaustion_is_error = false;
+		results.push_back(measure("put", "bytes", n_reps, [&](){
+			bpcs_stream.exhausted = false;
+			bpcs_stream.load_next_img();
+		}, [&](){
+			return Bench::put_all(bpcs_stream, data.data(), capacity);
+		}));
+		results.push_back(measure("merge_channels", "bytes", n_reps, [&](){
+			Bench::dirty_every_grid(bpcs_stream);
+		}, [&](){
+			return Bench::merge_channels(bpcs_stream);
+		}));
+	}
+
+	/* Whole jobs, over every image */
+	{
+		uint64_t total_capacity;
+		{
+			BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, n_imgs, vessel_fps_c.data(), false, nullptr);
+			bpcs_stream.load_next_img(); // Finds the first grid
+			total_capacity = (1 + Bench::walk(bpcs_stream)) * DefaultGrid::n_bytes;
+		}
+	  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+		results.push_back(measure("count", "bytes", n_reps, [&](){
+			BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, n_imgs, vessel_fps_c.data(), false, nullptr);
+			Bench::count(bpcs_stream);
+			return uint64_t(n_imgs) * img_sz; // Of the images counted, rather than of their capacity
+		}));
+	  #endif
+
+		// Fills most of the images, as a stream that did not fit would be an error
+		const uint64_t n_bytes = (total_capacity / 10) * 9;
+		std::vector<uchar> data(n_bytes);
+		synth::Rng{spec.seed}.fill(data.data(), n_bytes);
+		results.push_back(measure("embed", "bytes", n_reps, [&](){
+			BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, n_imgs, vessel_fps_c.data(), true, &out_fmt[0]);
+			bpcs_stream.load_next_img();
+			const uint64_t n = Bench::put_all(bpcs_stream, data.data(), n_bytes);
+			uchar grid_bytes[DefaultGrid::n_bytes] = {};
+			bpcs_stream.put(grid_bytes);
+			bpcs_stream.save_im();
+			return n;
+		}));
+
+		// Only the images that the data reached were written
+		int n_out_imgs = 0;
+		while ((n_out_imgs < n_imgs)  and  (access(out_fps_c[n_out_imgs], F_OK) == 0))
+			++n_out_imgs;
+		std::vector<uchar> out(n_imgs * img_sz); // More than any image's capacity, in case embedding changed it
+		results.push_back(measure("extract", "bytes", n_reps, [&](){
+			BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, n_out_imgs, out_fps_c.data(), false, nullptr);
+			bpcs_stream.load_next_img();
+			uint64_t n = 0;
+			do {
+				bpcs_stream.get(out.data() + n);
+				n += DefaultGrid::n_bytes;
+			} while (not bpcs_stream.exhausted);
+			return n;
+		}));
+		if (unlikely(memcmp(out.data(), data.data(), (n_bytes / DefaultGrid::n_bytes) * DefaultGrid::n_bytes) != 0)){
+			fprintf(stderr, "Extracted data differs from the embedded data\n");
+			return MISC_ERROR;
+		}
+
+		for (int img_n = 0;  img_n < n_imgs;  ++img_n){
+			unlink(vessel_fps_c[img_n]);
+			unlink(out_fps_c[img_n]);
+		}
+		rmdir(dir.c_str());
+	}
+
+	FILE* const f = (out_fp == nullptr) ? stdout : fopen(out_fp, "w");
+	if (unlikely(f == nullptr))
+		handler(CANNOT_CREATE_FILE);
+	fprintf(f, "{\n\t\"config\": {\n\t\t\"label\": ");
+	json::print_str(f, label);
+	fprintf(f, ",\n\t\t\"compiler\": ");
+	json::print_str(f, __VERSION__);
+	fprintf(f, ",\n\t\t\"complexity_engine\": \"%s\",\n\t\t\"grid_w\": %u,\n\t\t\"grid_h\": %u,\n\t\t\"n_channels\": %d",  COMPLEXITY_ENGINE_NAME,  DefaultGrid::w,  DefaultGrid::h,  N_CHANNELS);
+	print_bool(f, "enable_threads",
+	  #ifdef ENABLE_THREADS
+		true
+	  #else
+		false
+	  #endif
+	);
+	print_bool(f, "pipeline_images",
+	  #ifdef PIPELINE_IMAGES
+		true
+	  #else
+		false
+	  #endif
+	);
+	print_bool(f, "parallel_deflate",
+	  #ifdef PARALLEL_DEFLATE
+		true
+	  #else
+		false
+	  #endif
+	);
+	print_bool(f, "mmap_input",
+	  #ifdef MMAP_INPUT
+		true
+	  #else
+		false
+	  #endif
+	);
+	print_bool(f, "ssse3",
+	  #ifdef __SSSE3__
+		true
+	  #else
+		false
+	  #endif
+	);
+	print_bool(f, "avx2",
+	  #ifdef __AVX2__
+		true
+	  #else
+		false
+	  #endif
+	);
+	fprintf(f, ",\n\t\t\"kernels\": \"%s\"",  cpu::get_kernels_level());
+	fprintf(f, "\n\t},\n\t\"inputs\": {\n\t\t\"w\": %u,\n\t\t\"h\": %u,\n\t\t\"n_imgs\": %d,\n\t\t\"seed\": %lu,\n\t\t\"weights\": [",  spec.w,  spec.h,  n_imgs,  spec.seed);
+	for (int k = 0;  k <= synth::max_noise_bits;  ++k)
+		fprintf(f,  (k == 0) ? "%u" : ", %u",  spec.weights[k]);
+	fprintf(f, "],\n\t\t\"threshold\": %u,\n\t\t\"reps\": %u\n\t},\n\t\"results\": [",  min_complexity,  n_reps);
+	for (size_t i = 0;  i < results.size();  ++i){
+		Result& result = results[i];
+		std::sort(result.ns.begin(), result.ns.end());
+		uint64_t total_ns = 0;
+		for (const uint64_t ns : result.ns)
+			total_ns += ns;
+		const uint64_t median_ns = result.ns[result.ns.size() / 2];
+		fprintf(
+			  f
+			, "%s\n\t\t{\"name\": \"%s\", \"unit\": \"%s\", \"n\": %lu, \"min_ns\": %lu, \"median_ns\": %lu, \"mean_ns\": %lu, \"per_s\": %.1f}"
+			, (i == 0) ? "" : ","
+			, result.name
+			, result.unit
+			, result.n
+			, result.ns.front()
+			, median_ns
+			, total_ns / result.ns.size()
+			, (median_ns == 0) ? 0.0 : double(result.n) * 1e9 / median_ns
+		);
+	}
+	fprintf(f, "\n\t]\n}\n");
+	if (f != stdout)
+		fclose(f);
+	return 0;
+}
@@ -9,8 +9,14 @@
 # endif
 #endif
 
+#include "cpu.hpp"
 #include <compsky/macros/likely.hpp>
-#include <cstring> // for malloc
+#include <cstring> // for memcpy
+#include <algorithm> // for std::min
+#if (defined(__SSSE3__) || defined(CPU_DISPATCH)) && (N_CHANNELS == 3)
+# define SSSE3_SPLIT
+# include <tmmintrin.h>
+#endif
 
 /*
 * NOTE: While extracting, it is assumed that there is at least one full grid of bytes embedded in the vessel image.
@@ -19,149 +25,714 @@
 */
 
 
-/*
- * Bitwise operations on matrices
- */
-inline
-constexpr
-uint8_t to_cgc(const uint8_t n){
-	return n ^ (n / 2);
-}
+#ifdef SSSE3_SPLIT
+struct DeinterleaveMasks {
+	// Mask (3*k + v) gathers the elements of channel k of 16 pixels from the vth of the 3 vectors that they span
+	int8_t arr[N_CHANNELS * N_CHANNELS][16];
+	
+	constexpr
+	DeinterleaveMasks()
+	: arr()
+	{
+		for (unsigned k = 0;  k < N_CHANNELS;  ++k)
+			for (unsigned v = 0;  v < N_CHANNELS;  ++v)
+				for (unsigned i = 0;  i < 16;  ++i){
+					const unsigned src_indx = N_CHANNELS*i + k;
+					this->arr[N_CHANNELS*k + v][i] = (src_indx / 16 == v) ? (src_indx % 16) : -128; // Negative indices zero the element
+				}
+	}
+};
 
+constexpr static
+const DeinterleaveMasks deinterleave_masks;
+#endif
 
-constexpr
-unsigned get_grid_complexity(const uchar grid[GRID_SZ]){
-	unsigned sum = 0;
-	
-	// Complexity of horizontal neighbours
-	size_t _indx = 0;
-	for (auto j = 0;  j < GRID_H;  ++j){
-		for (auto i = 0;  i < GRID_W - 1;  ++i){
-			sum += grid[_indx] ^ grid[_indx + 1];
-			_indx += 1;
+#ifdef SSSE3_SPLIT
+template<bool is_cgc>
+TARGET_SSSE3
+size_t split_channels_ssse3(const uchar* const img_data,  uchar* const channel_byteplanes[N_CHANNELS],  size_t i,  const size_t end){
+	// Deinterleaves pixels from i in blocks of 16, returning the first pixel that is left
+	const __m128i lower_7_bits = _mm_set1_epi8(0x7f);
+	for (;  i + 16 <= end;  i += 16){
+		// Loaded one by one, as -Os otherwise copies them into the array with rep movs
+		const __m128i* const src = reinterpret_cast<const __m128i*>(img_data + N_CHANNELS*i);
+		const __m128i v[N_CHANNELS] = {_mm_loadu_si128(src),  _mm_loadu_si128(src + 1),  _mm_loadu_si128(src + 2)};
+		for (unsigned k = 0;  k < N_CHANNELS;  ++k){
+			const __m128i* const masks = reinterpret_cast<const __m128i*>(deinterleave_masks.arr[N_CHANNELS*k]);
+			__m128i channel = _mm_or_si128(
+				  _mm_or_si128(_mm_shuffle_epi8(v[0], _mm_loadu_si128(masks)),  _mm_shuffle_epi8(v[1], _mm_loadu_si128(masks + 1)))
+				, _mm_shuffle_epi8(v[2], _mm_loadu_si128(masks + 2))
+			);
+			if (is_cgc)
+				channel = _mm_xor_si128(channel,  _mm_and_si128(_mm_srli_epi16(channel, 1), lower_7_bits));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(channel_byteplanes[k] + i),  channel);
 		}
-		_indx += 1; // Skip the last column
 	}
-	
-	// Complexity of vertical neighbours
-	for (auto i = 0;  i < GRID_W;  ++i){
-		size_t _indx = i;
-		for (auto j = 0;  j < GRID_H - 1;  ++j){
-			sum += grid[_indx] ^ grid[_indx + GRID_W];
-			_indx += GRID_W;
+	return i;
+}
+#endif
+
+template<bool is_cgc>
+MULTIVERSIONED
+void split_channels_range(const uchar* const img_data,  uchar* const channel_byteplanes[N_CHANNELS],  size_t i,  const size_t end){
+	// Deinterleaves pixels [i, end), converting them to CGC if is_cgc
+  #ifdef SSSE3_SPLIT
+	if (cpu::has_ssse3())
+		i = split_channels_ssse3<is_cgc>(img_data, channel_byteplanes, i, end);
+  #endif
+	for (;  i < end;  ++i)
+		for (auto k = 0;  k < N_CHANNELS;  ++k){
+			const uchar px = img_data[N_CHANNELS*i + k];
+			channel_byteplanes[k][i] = (is_cgc) ? to_cgc(px) : px;
 		}
+}
+
+template<class G>
+void BPCSStreamBuf<G>::split_channels(){
+  #ifdef STATS
+	const stats::Timer timer(stats::SPLIT);
+  #endif
+	// RGBRGBRGBRGB... -> RRRR... GGGG... BBBB..., converting to CGC, in a single pass
+	// The pixels are left unchanged, so that only the modified parts of the image need to be written back to them
+	// NOTE: Only the first w*h elements of the pixel array are converted to CGC. This is how images have always been encoded, so must be kept for compatibility.
+	const size_t n_px = size_t(this->w) * this->h;
+	const size_t n_cgc = n_px;
+	if (unlikely(n_px == 0))
+		return;
+	const size_t n_cgc_px = n_cgc / N_CHANNELS; // Pixels whose elements are all converted
+	split_channels_range<true>(this->img_data, this->channel_byteplanes, 0, n_cgc_px);
+	for (auto k = 0;  k < N_CHANNELS;  ++k){
+		// The pixel on the boundary
+		const size_t px_indx = N_CHANNELS*n_cgc_px + k;
+		this->channel_byteplanes[k][n_cgc_px] = (px_indx < n_cgc) ? to_cgc(this->img_data[px_indx]) : this->img_data[px_indx];
 	}
-    
-    return sum;
+	split_channels_range<false>(this->img_data, this->channel_byteplanes, n_cgc_px + 1, n_px);
 }
 
 
-void BPCSStreamBuf::split_channels(){
-	// RGBRGBRGBRGB... -> RRRR... GGGG... BBBB...
-	for (auto i = 0;  i < this->w * this->h;  ++i){
-		for (auto k = 0;  k < N_CHANNELS;  ++k){
-			this->channel_byteplanes[k][i] = this->img_data[N_CHANNELS*i + k];
-		}
+template<class G>
+void BPCSStreamBuf<G>::extract_grid(uchar* arr,  size_t indx){
+	uchar* grid_itr = this->grid;
+	for (auto j = 0;  j < G::h;  ++j){
+		memcpy(grid_itr,  arr + indx,  G::w);
+		indx += this->w;
+		grid_itr += G::w;
 	}
 }
 
-void BPCSStreamBuf::merge_channels(){
-	// RRRR... GGGG... BBBB... -> RGBRGBRGBRGB...
-	for (auto i = 0;  i < this->w * this->h;  ++i){
-		for (auto k = 0;  k < N_CHANNELS;  ++k){
-			this->img_data[N_CHANNELS*i + k] = this->channel_byteplanes[k][i];
+#ifdef EMBEDDOR
+template<class G>
+void BPCSStreamBuf<G>::split_bitplane(){
+  #ifdef STATS
+	const stats::Timer timer(stats::SPLIT);
+  #endif
+  #ifdef TRACING
+	// The embedding counterpart of load_next_bitplane, whose bitplanes are indexed across the channels
+	this->trace_bitplane(this->bitplane_n);
+	const trace::Span span("split_bitplane", trace::Args{this->img_fps[this->img_n], this->bitplane_n});
+  #endif
+	uint64_t* const plane = this->bitplanes[this->bitplane_n];
+	packed::pack_bitplane(this->channel_byteplanes[this->bitplane_n / this->n_bitplanes],  plane,  this->w,  this->h,  this->packed_row_sz,  this->bitplane_n % this->n_bitplanes);
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	this->find_complex_grids(plane);
+  #endif
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	this->bitplane_complexities = this->grid_complexities + this->bitplane_n * this->n_grids;
+	this->grid_n = 0;
+  #endif
+}
+
+template<class G>
+void BPCSStreamBuf<G>::embed_grid(){
+	const uint32_t grid_x = this->x - G::w;
+	packed::pack_grid<G>(this->grid,  this->bitplanes[this->bitplane_n],  this->packed_row_sz,  grid_x,  this->y);
+	const size_t grid_indx = (this->y / G::h) * this->n_grids_hrztl  +  grid_x / G::w;
+	this->dirty_grids[grid_indx / 64] |= uint64_t(1) << (grid_indx % 64);
+}
+
+template<class G>
+MULTIVERSIONED
+void BPCSStreamBuf<G>::write_back_dirty_grids(){
+  #ifdef STATS
+	const stats::Timer timer(stats::MERGE);
+  #endif
+	const int n_planes = N_CHANNELS * this->n_bitplanes;
+	const int n_planes_split = (this->bitplane_n < n_planes) ? this->bitplane_n + 1 : n_planes;
+	const size_t n_cgc = size_t(this->w) * this->h;
+	uchar grid[G::sz];
+	for (size_t i = packed::find_next_set_bit(this->dirty_grids, 0, this->n_grids);  i != this->n_grids;  i = packed::find_next_set_bit(this->dirty_grids, i + 1, this->n_grids)){
+		const uint32_t grid_x = (i % this->n_grids_hrztl) * G::w;
+		const uint32_t grid_y = (i / this->n_grids_hrztl) * G::h;
+		const size_t indx = grid_x  +  size_t(grid_y) * this->w;
+		
+		for (auto k = 0;  k < n_planes_split;  ++k){
+			const unsigned bit_n = k % this->n_bitplanes;
+			if (bit_n >= 8)
+				// Does not fit in a byte
+				continue;
+			packed::unpack_grid<G>(this->bitplanes[k], this->packed_row_sz, grid_x, grid_y, grid);
+			uchar* const byteplane = this->channel_byteplanes[k / this->n_bitplanes];
+			for (auto j = 0;  j < G::h;  ++j)
+				for (auto _i = 0;  _i < G::w;  ++_i){
+					uchar& px = byteplane[indx + j * this->w + _i];
+					px = (px & ~(1 << bit_n))  |  (grid[G::w*j + _i] << bit_n);
+				}
 		}
+		
+		for (auto j = 0;  j < G::h;  ++j)
+			for (auto _i = 0;  _i < G::w;  ++_i){
+				const size_t px_indx = indx + j * this->w + _i;
+				for (auto k = 0;  k < N_CHANNELS;  ++k){
+					// See the note in split_channels
+					const uchar val = this->channel_byteplanes[k][px_indx];
+					this->img_data[N_CHANNELS*px_indx + k] = (N_CHANNELS*px_indx + k < n_cgc) ? from_cgc[val] : val;
+				}
+			}
 	}
 }
+#endif
+
+template<class G>
+inline void BPCSStreamBuf<G>::conjugate_grid(){
+	conjugate<G>(this->grid);
+  #ifdef STATS
+	++this->grid_counts.n_conjugated;
+  #endif
+}
 
+#ifdef COMPLEXITY_ENGINE_PACKED
+template<class G>
+void BPCSStreamBuf<G>::scan_bitplane(const uchar* arr,  const unsigned bit_n){
+  #ifdef STATS
+	const stats::Timer timer(stats::SPLIT);
+  #endif
+	packed::pack_bitplane(arr, this->packed_bitplane, this->w, this->h, this->packed_row_sz, bit_n);
+	this->find_complex_grids(this->packed_bitplane);
+	
+  #ifdef CROSS_CHECK_KERNELS
+	// Compare against the reference implementation
+	for (size_t i = 0;  i < this->n_grids;  ++i){
+		size_t indx = (i % this->n_grids_hrztl) * G::w  +  (i / this->n_grids_hrztl) * G::h * this->w;
+		for (auto j = 0;  j < G::h;  ++j){
+			for (auto k = 0;  k < G::w;  ++k)
+				this->grid[G::w*j + k] = (arr[indx + k] >> bit_n) & 1;
+			indx += this->w;
+		}
+		const bool is_complex = (get_grid_complexity<G>(this->grid) >= this->min_complexity);
+		if (unlikely(is_complex != ((this->complex_grids[i / 64] >> (i % 64)) & 1)))
+			handler(KERNEL_MISMATCH);
+	}
+  #endif
+}
 
-void BPCSStreamBuf::convert_to_cgc(uchar* arr){
-	for (uint64_t i = 0;  i < this->w * this->h;  ++i)
-		arr[i]  =  to_cgc(arr[i]);
+template<class G>
+void BPCSStreamBuf<G>::find_complex_grids(const uint64_t* plane){
+  #ifdef STATS
+	const stats::Timer timer(stats::COMPLEXITIES);
+  #endif
+	packed::find_complex_grids<G>(plane, this->w, this->h, this->packed_row_sz, this->min_complexity, this->complex_grids, this->kernel_scratch);
+	this->grid_n = 0;
 }
+#endif
 
-void BPCSStreamBuf::convert_from_cgc(uchar* arr){
-	constexpr
-	static
-	const uint8_t from_cgc[256] = {0, 1, 3, 2, 7, 6, 4, 5, 15, 14, 12, 13, 8, 9, 11, 10, 31, 30, 28, 29, 24, 25, 27, 26, 16, 17, 19, 18, 23, 22, 20, 21, 63, 62, 60, 61, 56, 57, 59, 58, 48, 49, 51, 50, 55, 54, 52, 53, 32, 33, 35, 34, 39, 38, 36, 37, 47, 46, 44, 45, 40, 41, 43, 42, 127, 126, 124, 125, 120, 121, 123, 122, 112, 113, 115, 114, 119, 118, 116, 117, 96, 97, 99, 98, 103, 102, 100, 101, 111, 110, 108, 109, 104, 105, 107, 106, 64, 65, 67, 66, 71, 70, 68, 69, 79, 78, 76, 77, 72, 73, 75, 74, 95, 94, 92, 93, 88, 89, 91, 90, 80, 81, 83, 82, 87, 86, 84, 85, 255, 254, 252, 253, 248, 249, 251, 250, 240, 241, 243, 242, 247, 246, 244, 245, 224, 225, 227, 226, 231, 230, 228, 229, 239, 238, 236, 237, 232, 233, 235, 234, 192, 193, 195, 194, 199, 198, 196, 197, 207, 206, 204, 205, 200, 201, 203, 202, 223, 222, 220, 221, 216, 217, 219, 218, 208, 209, 211, 210, 215, 214, 212, 213, 128, 129, 131, 130, 135, 134, 132, 133, 143, 142, 140, 141, 136, 137, 139, 138, 159, 158, 156, 157, 152, 153, 155, 154, 144, 145, 147, 146, 151, 150, 148, 149, 191, 190, 188, 189, 184, 185, 187, 186, 176, 177, 179, 178, 183, 182, 180, 181, 160, 161, 163, 162, 167, 166, 164, 165, 175, 174, 172, 173, 168, 169, 171, 170};
+#ifdef COMPLEXITY_ENGINE_BYTEPLANE
+template<class G>
+void BPCSStreamBuf<G>::calc_grid_complexities(){
+  #ifdef STATS
+	const stats::Timer timer(stats::COMPLEXITIES);
+  #endif
+	const size_t n_grids_per_channel = this->n_bitplanes * this->n_grids;
+	for (auto k = 0;  k < N_CHANNELS;  ++k)
+		byteplane::get_grid_complexities<G>(this->channel_byteplanes[k], this->w, this->h, this->n_bitplanes, this->grid_complexities + k * n_grids_per_channel, this->kernel_scratch);
 	
-	for (uint64_t i = 0;  i < this->w * this->h;  ++i)
-		arr[i]  =  from_cgc[arr[i]];
+  #ifdef CROSS_CHECK_KERNELS
+	// Compare against the reference implementation
+	const complexity_typ* itr = this->grid_complexities;
+	for (auto k = 0;  k < N_CHANNELS;  ++k){
+		for (auto n = 0;  n < this->n_bitplanes;  ++n){
+			for (size_t i = 0;  i < this->n_grids;  ++i){
+				this->extract_grid_bits(this->grid,  this->channel_byteplanes[k],  (i % this->n_grids_hrztl) * G::w  +  (i / this->n_grids_hrztl) * G::h * this->w,  n);
+				if (unlikely(get_grid_complexity<G>(this->grid) != *(itr++)))
+					handler(KERNEL_MISMATCH);
+			}
+		}
+	}
+  #endif
 }
 
+#ifdef COMPLEXITY_INDEX
+template<class G>
+bool BPCSStreamBuf<G>::read_complexity_index(){
+	if (not bpcsidx::read<G>(this->img_fps[this->img_n], this->w, this->h, this->n_bitplanes, this->grid_complexities, this->grid_complexities_sz))
+		return false;
+  #ifdef CHITTY_CHATTY
+	fprintf(stderr,  "Using complexity index of: %s\n",  this->img_fps[this->img_n]);
+  #endif
+	this->n_grids_hrztl = this->w / G::w;
+	this->n_grids = this->n_grids_hrztl * (this->h / G::h);
+	return true;
+}
 
-inline void BPCSStreamBuf::byteplane_div2(uchar* arr){
-	for (auto i = 0;  i < this->w * this->h;  ++i)
-		arr[i] /= 2;
+template<class G>
+void BPCSStreamBuf<G>::write_complexity_index() const {
+	bpcsidx::write<G>(this->img_fps[this->img_n], this->w, this->h, this->n_bitplanes, this->grid_complexities);
 }
+#endif
 
-void BPCSStreamBuf::extract_grid(uchar* arr,  size_t indx){
-	uchar* grid_itr = this->grid;
-	for (auto j = 0;  j < GRID_H;  ++j){
-		memcpy(grid_itr,  arr + indx,  GRID_W);
+template<class G>
+void BPCSStreamBuf<G>::extract_grid_bits(uchar* grid_itr,  const uchar* arr,  size_t indx,  const unsigned bit_n) const {
+	for (auto j = 0;  j < G::h;  ++j){
+		for (auto i = 0;  i < G::w;  ++i)
+			grid_itr[i] = (arr[indx + i] >> bit_n) & 1;
 		indx += this->w;
-		grid_itr += GRID_W;
+		grid_itr += G::w;
 	}
 }
+#endif
 
-void BPCSStreamBuf::embed_grid(uchar* arr,  size_t indx){
-	uchar* grid_itr = this->grid;
-	for (auto j = 0;  j < GRID_H;  ++j){
-		memcpy(arr + indx,  grid_itr,  GRID_W);
-		indx += this->w;
-		grid_itr += GRID_W;
+template<class G>
+inline void BPCSStreamBuf<G>::load_next_bitplane(){
+  #ifdef TRACING
+	const int bitplane_indx = this->channel_n * this->n_bitplanes + this->bitplane_n;
+	this->trace_bitplane(bitplane_indx);
+	const trace::Span span("load_next_bitplane", trace::Args{this->img_fps[this->img_n], bitplane_indx});
+  #endif
+  #if defined(COMPLEXITY_ENGINE_BYTEPLANE)
+	// The byteplane is left intact, as the grids are read directly from it
+	this->bitplane_complexities = this->grid_complexities + (this->channel_n * this->n_bitplanes + this->bitplane_n) * this->n_grids;
+	this->grid_n = 0;
+  #else
+	// The byteplane is left intact, as the bitplane is taken from it with a shift
+   #ifdef COMPLEXITY_ENGINE_PACKED
+	this->scan_bitplane(this->channel_byteplanes[this->channel_n], this->bitplane_n);
+   #else
+    #ifdef STATS
+	const stats::Timer timer(stats::SPLIT);
+    #endif
+	const uchar* const byteplane = this->channel_byteplanes[this->channel_n];
+	const size_t n_px = size_t(this->w) * this->h;
+	for (size_t i = 0;  i < n_px;  ++i)
+		this->bitplane[i] = (byteplane[i] >> this->bitplane_n) & 1;
+   #endif
+  #endif
+}
+
+template<class G>
+void BPCSStreamBuf<G>::load_next_channel(){
+    this->bitplane_n = 0;
+    this->load_next_bitplane();
+}
+
+template<class G>
+BPCSStreamBuf<G>::~BPCSStreamBuf(){
+  #ifdef STATS
+	this->add_img_stats(this->exhausted);
+  #endif
+  #ifdef TRACING
+	this->trace_bitplane(-1);
+  #endif
+  #ifdef PIPELINE_IMAGES
+	if (this->decoder.joinable())
+		this->decoder.join();
+   #ifdef EMBEDDOR
+	if (this->encoder.joinable()){
+	  #ifdef STATS
+		const stats::Timer timer(stats::ENCODE);
+	  #endif
+		this->encoder.join();
+	}
+   #endif
+  #endif
+	alloc::free(this->allocator, this->buffers);
+}
+
+template<class G>
+void BPCSStreamBuf<G>::decode_img(const int n){
+  #ifdef STATS
+	// The stream only moves on from an image once it has walked all of its grids
+	this->add_img_stats(true);
+  #endif
+	this->img_n = n;
+	if (this->buffers == nullptr)
+		this->reserve_buffers();
+  #ifdef DAEMON
+	if (this->vessel_cache != nullptr){
+		// Vessels that are used by many jobs are decoded only once, by the first
+		bool is_decoded = false;
+		const std::shared_ptr<const Vessel> vessel = this->vessel_cache->get(this->img_fps[n],  [this, &is_decoded](){
+			this->read_img();
+			is_decoded = true;
+			return this->to_vessel();
+		});
+		if (not is_decoded)
+			this->load_vessel(*vessel);
+		return;
+	}
+  #endif
+	this->read_img();
+  #ifdef STATS
+	this->stats_img_n = n;
+  #endif
+}
+
+#ifdef STATS
+template<class G>
+void BPCSStreamBuf<G>::add_img_stats(const bool is_walked){
+	if (this->stats_img_n == -1)
+		return;
+	if (stats::is_enabled){
+		int64_t capacity = -1;
+	  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+		capacity = 0;
+		for (int i = 0;  i < N_CHANNELS * this->n_bitplanes;  ++i)
+			capacity += this->count_complex_grids(i);
+	   #ifdef ONLY_COUNT
+		// The grids are not walked, but every complexity is compared with the threshold
+		this->grid_counts.n_scanned = N_CHANNELS * this->n_bitplanes * this->n_grids;
+		this->grid_counts.n_accepted = capacity;
+	   #endif
+		capacity *= G::n_bytes;
+	  #else
+		if (is_walked)
+			capacity = this->grid_counts.n_accepted * G::n_bytes;
+	  #endif
+		stats::add_img(this->stats_img_n, this->img_fps[this->stats_img_n], this->w, this->h, this->n_bitplanes, capacity, this->grid_counts);
 	}
+	this->grid_counts = stats::GridCounts();
+	this->stats_img_n = -1;
 }
+#endif
 
-inline void BPCSStreamBuf::conjugate_grid(){
-	for (auto j = 0;  j < GRID_H;  ++j)
-		for (auto i = 0;  i < GRID_W;  ++i)
-			this->grid[GRID_W*j + i] ^= 1 ^ ((i & 1) ^ (j & 1));
-			// NOTE: chequerboard.val[0] should be 1, so that when the chequerboard is applied to grids, the grid[CONJUGATION_BIT_INDX] == 1 (to mark it as conjugated)
+#ifdef TRACING
+template<class G>
+void BPCSStreamBuf<G>::trace_bitplane(const int bitplane_n){
+	if (not trace::is_enabled)
+		return;
+	const uint64_t now = trace::now();
+	if (this->trace_bitplane_n != -1)
+		trace::add_event("bitplane", this->trace_bitplane_start_ns, now, true, trace::Args{this->img_fps[this->img_n], this->trace_bitplane_n});
+	this->trace_bitplane_n = bitplane_n;
+	this->trace_bitplane_start_ns = now;
 }
+#endif
 
-inline void BPCSStreamBuf::load_next_bitplane(){
-	for (auto i = 0;  i < this->w * this->h;  ++i)
-		this->bitplane[i] = this->channel_byteplanes[this->channel_n][i] & 1;
-	this->byteplane_div2(this->channel_byteplanes[this->channel_n]);
+#ifdef PRECALCULATED_COMPLEXITIES
+template<class G>
+static
+size_t get_kernel_scratch_sz(const uint32_t w){
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	return packed::get_scratch_sz<G>(w);
+  #else
+	return byteplane::get_scratch_sz<G>(w);
+  #endif
 }
+#endif
 
-void BPCSStreamBuf::load_next_channel(){
-    this->bitplane_n = 0;
-    this->load_next_bitplane();
+template<class G>
+void BPCSStreamBuf<G>::set_channel_byteplanes(){
+	const size_t n_px = size_t(this->w) * this->h;
+	uchar* itr = this->img_data + (N_CHANNELS * n_px);
+	for (auto i = 0;  i < N_CHANNELS;  ++i){
+		this->channel_byteplanes[i] = itr;
+		itr += n_px;
+	}
+	this->bitplane = itr;
+	// The buffers were sized from the headers of the images, so are only too small if an image has since been replaced
+	if (unlikely((png::get_img_data_sz(this->w, this->h) > this->img_data_sz)  or  (this->n_bitplanes > this->max_n_bitplanes)))
+		handler(VESSEL_CHANGED);
+  #if defined(COMPLEXITY_ENGINE_PACKED) || defined(EMBEDDOR)
+	this->packed_row_sz = packed::get_row_sz(this->w);
+	if (unlikely(packed::get_plane_sz(this->w, this->h) > this->max_plane_sz))
+		handler(VESSEL_CHANGED);
+  #endif
+  #if defined(PRECALCULATED_COMPLEXITIES) || defined(EMBEDDOR)
+	this->n_grids_hrztl = this->w / G::w;
+	this->n_grids = this->n_grids_hrztl * (this->h / G::h);
+	if (unlikely(this->n_grids > this->max_n_grids))
+		handler(VESSEL_CHANGED);
+  #endif
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	if (unlikely(N_CHANNELS * size_t(this->n_bitplanes) * this->n_grids > this->grid_complexities_sz))
+		handler(VESSEL_CHANGED);
+  #endif
+  #ifdef PRECALCULATED_COMPLEXITIES
+	if (unlikely(get_kernel_scratch_sz<G>(this->w) > this->kernel_scratch_sz))
+		handler(VESSEL_CHANGED);
+  #endif
 }
 
-void BPCSStreamBuf::load_next_img(){
-	if(unlikely(this->img_n == this->n_imgs))
-		handler(TOO_MUCH_DATA_TO_ENCODE);
+#ifdef DAEMON
+template<class G>
+std::shared_ptr<const Vessel> BPCSStreamBuf<G>::to_vessel() const {
+	const size_t n_px = size_t(this->w) * this->h;
+	const std::shared_ptr<Vessel> vessel = std::make_shared<Vessel>();
+	vessel->w = this->w;
+	vessel->h = this->h;
+	vessel->n_bitplanes = this->n_bitplanes;
+	vessel->png_bg = this->png_bg;
+	vessel->has_png_bg = this->has_png_bg;
+	vessel->img_data.assign(this->img_data,  this->img_data + 2 * N_CHANNELS * n_px);
+	vessel->grid_complexities.assign(this->grid_complexities,  this->grid_complexities + N_CHANNELS * this->n_bitplanes * this->n_grids);
+	return vessel;
+}
+
+template<class G>
+void BPCSStreamBuf<G>::load_vessel(const Vessel& vessel){
+	this->w = vessel.w;
+	this->h = vessel.h;
+	this->n_bitplanes = vessel.n_bitplanes;
+	this->png_bg = vessel.png_bg;
+	this->has_png_bg = vessel.has_png_bg;
+	this->set_channel_byteplanes();
+	const size_t n_px = size_t(this->w) * this->h;
+	// Extracting only reads the byteplanes, so the pixels need not be copied
+	const size_t offset = (this->embedding) ? 0 : N_CHANNELS * n_px;
+	memcpy(this->img_data + offset,  vessel.img_data.data() + offset,  vessel.img_data.size() - offset);
+	memcpy(this->grid_complexities,  vessel.grid_complexities.data(),  vessel.grid_complexities.size() * sizeof(complexity_typ));
+}
+#endif
+
+template<class G>
+void BPCSStreamBuf<G>::reserve_buffers(){
+	// Every buffer is carved from one block, sized from the headers of the images, so that moving from one image to the next never allocates
+	// Each buffer is sized for the image that needs the most of it, so a wide image and a tall image need no more than the larger of them
+	this->img_data_sz = 0;
+  #if defined(COMPLEXITY_ENGINE_PACKED) || defined(EMBEDDOR)
+	this->max_plane_sz = 0;
+  #endif
+	this->max_n_grids = 0;
+	this->max_n_bitplanes = 0;
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	this->grid_complexities_sz = 0;
+  #endif
+  #ifdef PRECALCULATED_COMPLEXITIES
+	this->kernel_scratch_sz = 0;
+  #endif
+	for (int n = this->img_n_offset;  n < this->n_imgs;  ++n){
+		png::Header header;
+	  #ifdef LIBBPCS
+		if (not png::read_header_from_memory(this->img_bufs[n].data, this->img_bufs[n].sz, header))
+	  #else
+		if (not png::read_header(this->img_fps[n], header))
+	  #endif
+			// Reported when the image is decoded, if it ever is
+			continue;
+		const size_t n_grids = size_t(header.w / G::w) * (header.h / G::h);
+		this->img_data_sz = std::max(this->img_data_sz,  png::get_img_data_sz(header.w, header.h));
+	  #if defined(COMPLEXITY_ENGINE_PACKED) || defined(EMBEDDOR)
+		this->max_plane_sz = std::max(this->max_plane_sz,  packed::get_plane_sz(header.w, header.h));
+	  #endif
+		this->max_n_grids = std::max(this->max_n_grids,  n_grids);
+		this->max_n_bitplanes = std::max(this->max_n_bitplanes,  header.n_bitplanes);
+	  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+		this->grid_complexities_sz = std::max(this->grid_complexities_sz,  N_CHANNELS * size_t(header.n_bitplanes) * n_grids);
+	  #endif
+	  #ifdef PRECALCULATED_COMPLEXITIES
+		this->kernel_scratch_sz = std::max(this->kernel_scratch_sz,  get_kernel_scratch_sz<G>(header.w));
+	  #endif
+	}
+  #if defined(COMPLEXITY_ENGINE_PACKED) || defined(EMBEDDOR)
+	// Bitplanes are packed, so take an eighth of the memory they would as bytes
+	const size_t plane_sz = this->max_plane_sz * sizeof(uint64_t);
+	const size_t bitmap_sz = packed::get_bitmap_sz(this->max_n_grids) * sizeof(uint64_t);
+  #endif
+	
+	size_t sz = 0;
+	const auto reserve = [&sz](const size_t n_bytes){
+		// Returns the offset of a buffer of n_bytes, each buffer beginning on a cache line of its own
+		const size_t offset = sz;
+		sz += (n_bytes + 63) & ~size_t(63);
+		return offset;
+	};
+	const size_t img_data_offset = reserve(this->img_data_sz);
+  #ifdef PIPELINE_IMAGES
+	const bool is_pipelined = (this->n_imgs - this->img_n_offset > 1);
+	const size_t next_img_data_offset = reserve((is_pipelined) ? this->img_data_sz : 0);
+   #ifdef EMBEDDOR
+	const size_t prev_img_data_offset = reserve((this->embedding) ? this->img_data_sz : 0);
+   #endif
+  #endif
+  #ifdef EMBEDDOR
+	const int n_bitplanes = (this->embedding) ? std::min(N_CHANNELS * this->max_n_bitplanes,  MAX_BITPLANES) : 0;
+	const size_t bitplanes_offset = reserve(n_bitplanes * plane_sz);
+	const size_t dirty_grids_offset = reserve((this->embedding) ? bitmap_sz : 0);
+  #endif
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	const size_t packed_bitplane_offset = reserve(plane_sz);
+	const size_t complex_grids_offset = reserve(bitmap_sz);
+  #endif
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	const size_t grid_complexities_offset = reserve(this->grid_complexities_sz * sizeof(complexity_typ));
+  #endif
+  #ifdef PRECALCULATED_COMPLEXITIES
+	const size_t kernel_scratch_offset = reserve(this->kernel_scratch_sz);
+  #endif
+	
+  #ifdef HUGE_PAGES
+	// With a huge page to spare, so that the buffers can begin on a huge page boundary
+	sz = (sz + alloc::huge_page_sz - 1)  &  ~(alloc::huge_page_sz - 1);
+	this->buffers = alloc::malloc(this->allocator,  sz + alloc::huge_page_sz);
+  #else
+	this->buffers = alloc::malloc(this->allocator,  sz);
+  #endif
+	if (unlikely(this->buffers == nullptr))
+		handler(OOM);
+  #ifdef HUGE_PAGES
+	uchar* const block = (uchar*)alloc::advise_huge_pages(this->buffers, sz);
+  #else
+	uchar* const block = (uchar*)this->buffers;
+  #endif
+	this->img_data = block + img_data_offset;
+  #ifdef PIPELINE_IMAGES
+	if (is_pipelined)
+		this->next_img_data = block + next_img_data_offset;
+   #ifdef EMBEDDOR
+	if (this->embedding)
+		this->prev_img_data = block + prev_img_data_offset;
+   #endif
+  #endif
+  #ifdef EMBEDDOR
+	for (int k = 0;  k < n_bitplanes;  ++k)
+		this->bitplanes[k] = (uint64_t*)(block + bitplanes_offset + k * plane_sz);
+	if (this->embedding)
+		this->dirty_grids = (uint64_t*)(block + dirty_grids_offset);
+  #endif
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	this->packed_bitplane = (uint64_t*)(block + packed_bitplane_offset);
+	this->complex_grids = (uint64_t*)(block + complex_grids_offset);
+  #endif
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	this->grid_complexities = (complexity_typ*)(block + grid_complexities_offset);
+  #endif
+  #ifdef PRECALCULATED_COMPLEXITIES
+	this->kernel_scratch = block + kernel_scratch_offset;
+  #endif
+}
+
+#if defined(PIPELINE_IMAGES) || defined(MMAP_INPUT)
+template<class G>
+bool BPCSStreamBuf<G>::is_decode_needed(const int n) const {
+  #if defined(COMPLEXITY_INDEX) && defined(ONLY_COUNT)
+	return not bpcsidx::is_valid<G>(this->img_fps[n], this->grid_complexities_sz);
+  #else
+	return true;
+  #endif
+}
+#endif
+
+template<class G>
+void BPCSStreamBuf<G>::read_img(){
+  #ifdef STATS
+	const stats::Timer timer(stats::DECODE);
+  #endif
+  #if defined(COMPLEXITY_INDEX) && defined(ONLY_COUNT)
+	// Only the complexities are needed, so the image need not be decoded at all
+	if (this->read_complexity_index())
+		return;
+  #endif
     /* Load PNG file into array */
-  #ifdef CHITTY_CHATTY
-	fprintf(stderr,  "Loading image: %s\n",  this->img_fps[this->img_n]);
+  #ifdef PIPELINE_IMAGES
+	if (this->decoder.joinable())
+		this->decoder.join();
+	if (this->next_img_n == this->img_n){
+		std::swap(this->img_data,  this->next_img_data);
+		this->w = this->next_w;
+		this->h = this->next_h;
+		this->n_bitplanes = this->next_n_bitplanes;
+	  #ifdef EMBEDDOR
+		this->png_bg = this->next_png_bg;
+		this->has_png_bg = this->next_has_png_bg;
+	  #endif
+	} else {
   #endif
+  #ifdef LIBBPCS
+	png::read_from_memory(
+		  this->img_bufs[this->img_n].data
+		, this->img_bufs[this->img_n].sz
+  #else
+   #ifdef CHITTY_CHATTY
+	fprintf(stderr,  "Loading image: %s\n",  this->img_fps[this->img_n]);
+   #endif
 	png::read(
 		  this->img_fps[this->img_n]
-		, this->n_imgs
+  #endif
 		, this->img_data
 		, this->img_data_sz
+		, this->allocator
 		, this->w
 		, this->h
 		, this->n_bitplanes
 	  #ifdef EMBEDDOR
 		, this->png_bg
+		, this->has_png_bg
 	  #endif
 	);
-	const auto img_width_by_height = this->w * this->h;
+  #ifdef STATS
+	stats::add_file_sz(stats::PNG_BYTES_IN, this->img_fps[this->img_n]);
+  #endif
+  #ifdef PIPELINE_IMAGES
+	}
+	
+	// next_img_data is no longer in use, as it held the previous image (which has been finished with, or swapped out to the encoder by save_im)
+	if ((this->img_n + 1 < this->n_imgs)  and  this->is_decode_needed(this->img_n + 1)){
+		this->next_img_n = this->img_n + 1;
+		this->decoder = std::thread([this](){
+		  #ifdef STATS
+			const stats::Timer timer(stats::DECODE);
+		  #endif
+		  #ifdef CHITTY_CHATTY
+			fprintf(stderr,  "Loading image: %s\n",  this->img_fps[this->next_img_n]);
+		  #endif
+			png::read(
+				  this->img_fps[this->next_img_n]
+				, this->next_img_data
+				, this->img_data_sz
+				, this->allocator
+				, this->next_w
+				, this->next_h
+				, this->next_n_bitplanes
+			  #ifdef EMBEDDOR
+				, this->next_png_bg
+				, this->next_has_png_bg
+			  #endif
+			);
+		  #ifdef STATS
+			stats::add_file_sz(stats::PNG_BYTES_IN, this->img_fps[this->next_img_n]);
+		  #endif
+		});
+	} else
+		this->next_img_n = -1;
+  #endif
+  #ifdef MMAP_INPUT
 	{
-		uchar* itr = this->img_data + (N_CHANNELS * img_width_by_height);
-		for (auto i = 0;  i < N_CHANNELS;  ++i){
-			this->channel_byteplanes[i] = itr;
-			itr += img_width_by_height;
-		}
-		this->bitplane = itr;
+		// Have the OS read the image after those being decoded, so that it is in the page cache by the time it is needed
+	  #ifdef PIPELINE_IMAGES
+		const int prefetch_img_n = this->img_n + 2;
+	  #else
+		const int prefetch_img_n = this->img_n + 1;
+	  #endif
+		if ((prefetch_img_n < this->n_imgs)  and  this->is_decode_needed(prefetch_img_n))
+			png::prefetch(this->img_fps[prefetch_img_n]);
 	}
-    
-	this->convert_to_cgc(this->img_data);
+  #endif
+	this->set_channel_byteplanes();
 	this->split_channels();
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+   #if defined(COMPLEXITY_INDEX) && !defined(ONLY_COUNT)
+	if (not this->read_complexity_index())
+   #endif
+	this->calc_grid_complexities();
+  #endif
+}
+
+template<class G>
+void BPCSStreamBuf<G>::load_next_img(){
+	if(unlikely(this->img_n == this->n_imgs))
+		handler(TOO_MUCH_DATA_TO_ENCODE);
+  #ifdef TRACING
+	const trace::Span span("load_next_img", trace::Args{this->img_fps[this->img_n]});
+  #endif
+	this->decode_img(this->img_n);
   #ifdef EMBEDDOR
     if (!this->embedding)
   #endif
@@ -171,23 +742,11 @@ void BPCSStreamBuf::load_next_img(){
     
     #ifdef EMBEDDOR
     if (this->embedding){
-		auto k = 0;
-        for (auto j = 0;  j < N_CHANNELS;  ++j){
-			for (auto i = 0;  i < this->n_bitplanes;  ++i){
-				this->bitplanes[k] = (uchar*)malloc(this->w * this->h);
-				if (unlikely(this->bitplanes[k] == nullptr))
-					handler(OOM);
-				for (auto _i = 0;  _i < this->w * this->h;  ++_i)
-					this->bitplanes[k][_i] = this->channel_byteplanes[j][_i] & 1;
-				++k;
-				this->byteplane_div2(this->channel_byteplanes[j]);
-            }
-        }
-        this->bitplane = this->bitplanes[0];
+		memset(this->dirty_grids,  0,  packed::get_bitmap_sz(this->n_grids) * sizeof(uint64_t));
         this->bitplane_n = 0;
+		this->split_bitplane();
     } else {
     #endif
-		this->bitplane = (uchar*)malloc(this->w * this->h);
         this->load_next_channel();
     #ifdef EMBEDDOR
     }
@@ -201,7 +760,7 @@ void BPCSStreamBuf::load_next_img(){
     #endif
         if (this->img_n == this->img_n_offset){
             // If false, this function is being called from within get()
-            if (this->grid[CONJUGATION_BIT_INDX])
+            if (this->grid[G::conjugation_bit_indx])
                 this->conjugate_grid();
         }
     #ifdef EMBEDDOR
@@ -209,14 +768,60 @@ void BPCSStreamBuf::load_next_img(){
     #endif
 }
 
-void BPCSStreamBuf::set_next_grid(){
+template<class G>
+void BPCSStreamBuf<G>::set_next_grid(){
+  #if defined(STATS) && defined(PRECALCULATED_COMPLEXITIES)
+	const size_t first_grid_n = this->grid_n;
+  #endif
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	this->grid_n = packed::find_next_set_bit(this->complex_grids, this->grid_n, this->n_grids);
+	if (this->grid_n != this->n_grids){
+		this->x = (this->grid_n % this->n_grids_hrztl) * G::w  +  G::w;
+		this->y = (this->grid_n / this->n_grids_hrztl) * G::h;
+		++this->grid_n;
+	  #ifdef STATS
+		this->grid_counts.n_scanned += this->grid_n - first_grid_n;
+	  #endif
+	  #ifdef EMBEDDOR
+		// When embedding, the grid is about to be overwritten
+		if (!this->embedding)
+	  #endif
+		packed::unpack_grid<G>(this->packed_bitplane, this->packed_row_sz, this->x - G::w, this->y, this->grid);
+		return;
+	}
+  #elif defined(COMPLEXITY_ENGINE_BYTEPLANE)
+	for (;  this->grid_n != this->n_grids;  ++this->grid_n){
+		if (this->bitplane_complexities[this->grid_n] >= this->min_complexity){
+			this->x = (this->grid_n % this->n_grids_hrztl) * G::w  +  G::w;
+			this->y = (this->grid_n / this->n_grids_hrztl) * G::h;
+			++this->grid_n;
+		  #ifdef STATS
+			this->grid_counts.n_scanned += this->grid_n - first_grid_n;
+		  #endif
+		  #ifdef EMBEDDOR
+			// When embedding, the grid is about to be overwritten
+			if (!this->embedding)
+		  #endif
+			this->extract_grid_bits(this->grid,  this->channel_byteplanes[this->channel_n],  (this->x - G::w)  +  size_t(this->y) * this->w,  this->bitplane_n);
+			return;
+		}
+	}
+  #else
     int i = this->x;
-    for (int j=this->y;  j <= this->h - GRID_H;  j+=GRID_H, i=0){
-        while (i <= this->w - GRID_W){
-			this->extract_grid(this->bitplane, i + j * this->w); // For cache locality, copy the grid - which is fragmented - to a compact small array
-			const unsigned complexity = get_grid_complexity(this->grid);
+    for (int j=this->y;  j <= this->h - G::h;  j+=G::h, i=0){
+        while (i <= this->w - G::w){
+		  #ifdef EMBEDDOR
+			if (this->embedding)
+				packed::unpack_grid<G>(this->bitplanes[this->bitplane_n], this->packed_row_sz, i, j, this->grid);
+			else
+		  #endif
+			this->extract_grid(this->bitplane,  i  +  size_t(j) * this->w); // For cache locality, copy the grid - which is fragmented - to a compact small array
+			const unsigned complexity = get_grid_complexity<G>(this->grid);
+		  #ifdef STATS
+			++this->grid_counts.n_scanned;
+		  #endif
             
-            i += GRID_W;
+            i += G::w;
             
             if (complexity >= this->min_complexity){
                 this->x = i;
@@ -226,8 +831,12 @@ void BPCSStreamBuf::set_next_grid(){
             }
         }
     }
+  #endif
     
     // If we are here, we have exhausted the bitplane
+  #if defined(STATS) && defined(PRECALCULATED_COMPLEXITIES)
+	this->grid_counts.n_scanned += this->grid_n - first_grid_n;
+  #endif
     
     this->x = 0;
     this->y = 0;
@@ -236,7 +845,7 @@ void BPCSStreamBuf::set_next_grid(){
     #ifdef EMBEDDOR
     if (this->embedding){
         if (this->bitplane_n < this->n_bitplanes * N_CHANNELS){
-            this->bitplane = this->bitplanes[this->bitplane_n];
+			this->split_bitplane();
             goto try_again;
         }
     } else
@@ -250,11 +859,15 @@ void BPCSStreamBuf::set_next_grid(){
     }
     
     // If we are here, we have exhausted the image
-    if (++this->img_n < this->n_imgs){
+  #ifdef TRACING
+	this->trace_bitplane(-1);
+  #endif
+    if (this->img_n + 1 < this->n_imgs){
 #ifdef EMBEDDOR
         if (this->embedding)
             this->save_im();
 #endif
+        ++this->img_n;
         this->load_next_img();
         return;
     }
@@ -263,7 +876,7 @@ void BPCSStreamBuf::set_next_grid(){
     // This is not necessarily alarming - this termination is used rather than returning status values for each get() call.
     
     #ifdef EMBEDDOR
-    if (this->embedding){
+    if (this->embedding and this->exhaustion_is_error){
 		handler(TOO_MUCH_DATA_TO_ENCODE);
     }
     #endif
@@ -274,61 +887,213 @@ void BPCSStreamBuf::set_next_grid(){
     this->set_next_grid();
 }
 
-void BPCSStreamBuf::get(uchar* msg_arr){
-    for (uint_fast8_t j=0; j<BYTES_PER_GRID; ++j){
-		msg_arr[j] = 0;
-        for (uint_fast8_t i=0; i<8; ++i){
-			msg_arr[j] |= this->grid[8*j +i] << i;
-        }
-    }
+template<class G>
+void BPCSStreamBuf<G>::get(uchar* msg_arr){
+  #ifdef STATS
+	++this->grid_counts.n_accepted;
+  #endif
+	grid_to_bytes<G>(this->grid, msg_arr);
     
     this->set_next_grid();
     
-    if (this->grid[CONJUGATION_BIT_INDX] != 0)
+    if (this->grid[G::conjugation_bit_indx] != 0)
         this->conjugate_grid();
 }
 
+#ifdef COMPLEXITY_ENGINE_BYTEPLANE
+template<class G>
+size_t BPCSStreamBuf<G>::count_complex_grids(const int bitplane_indx) const {
+	const complexity_typ* const complexities = this->grid_complexities + bitplane_indx * this->n_grids;
+	size_t n = 0;
+	for (size_t i = 0;  i < this->n_grids;  ++i)
+		n += (complexities[i] >= this->min_complexity);
+	return n;
+}
+#endif
+
+#ifdef RANDOM_ACCESS
+template<class G>
+void BPCSStreamBuf<G>::seek(uint64_t grid_indx){
+	// Used instead of load_next_img
+	// Only the complexities of the images before the grid are needed, so they are not decoded if they have a complexity index
+	if (this->buffers == nullptr)
+		// The index is read into grid_complexities, so they must be reserved before the first image
+		this->reserve_buffers();
+  #if defined(TESTS) && defined(STATS)
+	bool is_any_decoded = false;
+  #endif
+	for (;  this->img_n != this->n_imgs;  ++this->img_n){
+	  #ifdef COMPLEXITY_INDEX
+		const bool is_decoded = not this->read_complexity_index();
+	   #if defined(TESTS) && defined(STATS)
+		// Images before the first that is decoded are counted from their indexes alone
+		if (unlikely((not is_decoded)  and  (not is_any_decoded)  and  (stats::counters[stats::PNG_BYTES_IN] != 0)))
+			handler(MISC_ERROR);
+		is_any_decoded |= is_decoded;
+	   #endif
+		if (is_decoded)
+	  #endif
+		this->decode_img(this->img_n);
+		
+		for (int k = 0;  k < N_CHANNELS * this->n_bitplanes;  ++k){
+			const size_t n_complex_grids = this->count_complex_grids(k);
+			if (grid_indx >= n_complex_grids){
+				grid_indx -= n_complex_grids;
+				continue;
+			}
+			
+		  #ifdef COMPLEXITY_INDEX
+			if (not is_decoded)
+				this->decode_img(this->img_n);
+		  #endif
+			this->channel_n = k / this->n_bitplanes;
+			this->bitplane_n = k % this->n_bitplanes;
+			this->load_next_bitplane();
+			for (;  ;  ++this->grid_n)
+				if ((this->bitplane_complexities[this->grid_n] >= this->min_complexity)  and  (grid_indx-- == 0))
+					break;
+			this->set_next_grid();
+			if (this->grid[G::conjugation_bit_indx])
+				this->conjugate_grid();
+			return;
+		}
+	  #ifdef STATS
+		// The image was only counted, so is left out of the per-image stats, rather than being recorded later with the complexities of another
+		this->stats_img_n = -1;
+	  #endif
+	}
+	this->exhausted = true;
+}
+#endif
+
+#if defined(ENABLE_THREADS) || defined(LIBBPCS) || defined(DAEMON)
+template<class G>
+size_t BPCSStreamBuf<G>::get_bitplane_sz(const int bitplane_indx) const {
+	return this->count_complex_grids(bitplane_indx) * G::n_bytes;
+}
+
+template<class G>
+size_t BPCSStreamBuf<G>::get_img_sz() const {
+	size_t n = 0;
+	for (int i = 0;  i < N_CHANNELS * this->n_bitplanes;  ++i)
+		n += this->get_bitplane_sz(i);
+	return n;
+}
+
+template<class G>
+void BPCSStreamBuf<G>::get_bitplane(const int bitplane_indx,  uchar* msg_arr) const {
+	// Equivalent to calling get() for every grid of the bitplane, but only reads the image, so that different bitplanes can be extracted concurrently
+	const complexity_typ* const complexities = this->grid_complexities + bitplane_indx * this->n_grids;
+	const uchar* const byteplane = this->channel_byteplanes[bitplane_indx / this->n_bitplanes];
+	const unsigned bit_n = bitplane_indx % this->n_bitplanes;
+	uchar grid[G::sz];
+  #ifdef STATS
+	// Bitplanes are extracted concurrently, so their counts are added straight to the totals
+	const uchar* const msg_arr_start = msg_arr;
+	uint64_t n_conjugated = 0;
+  #endif
+	for (size_t i = 0;  i < this->n_grids;  ++i){
+		if (complexities[i] < this->min_complexity)
+			continue;
+		this->extract_grid_bits(grid,  byteplane,  (i % this->n_grids_hrztl) * G::w  +  (i / this->n_grids_hrztl) * G::h * this->w,  bit_n);
+		if (grid[G::conjugation_bit_indx] != 0){
+			conjugate<G>(grid);
+		  #ifdef STATS
+			++n_conjugated;
+		  #endif
+		}
+		grid_to_bytes<G>(grid, msg_arr);
+		msg_arr += G::n_bytes;
+	}
+  #ifdef STATS
+	stats::add(stats::GRIDS_SCANNED, this->n_grids);
+	stats::add(stats::GRIDS_ACCEPTED, (msg_arr - msg_arr_start) / G::n_bytes);
+	stats::add(stats::CONJUGATIONS, n_conjugated);
+  #endif
+}
+#endif
+
+#ifdef ONLY_COUNT
+template<class G>
+void BPCSStreamBuf<G>::add_to_histogram(uint64_t* histogram) const {
+	// Uses the complexities calculated by decode_img, so no grids are extracted
+	const complexity_typ* itr = this->grid_complexities;
+	for (auto k = 0;  k < N_CHANNELS;  ++k){
+		for (auto n = 0;  n < this->n_bitplanes;  ++n){
+			uint64_t* const counts = histogram  +  (k * MAX_BITPLANES + n) * (G::max_complexity + 1);
+			for (size_t i = 0;  i < this->n_grids;  ++i)
+				++counts[*(itr++)];
+		}
+	}
+}
+#endif
+
 #ifdef EMBEDDOR
-void BPCSStreamBuf::put(uchar* in){
-    for (uint_fast8_t j=0; j<BYTES_PER_GRID; ++j){
+template<class G>
+void BPCSStreamBuf<G>::put(uchar* in){
+  #ifdef STATS
+	++this->grid_counts.n_accepted;
+  #endif
+    for (uint_fast8_t j=0; j<G::n_bytes; ++j){
         for (uint_fast8_t i=0; i<8; ++i){
             this->grid[8*j +i] = in[j] & 1;
             in[j] = in[j] >> 1;
         }
 	}
     
-    this->grid[CONJUGATION_BIT_INDX] = 0;
+    this->grid[G::conjugation_bit_indx] = 0;
     
-    if (get_grid_complexity(this->grid) < this->min_complexity)
+    if (get_grid_complexity<G>(this->grid) < this->min_complexity)
         this->conjugate_grid();
     
-	this->embed_grid(this->bitplane,  (this->x - GRID_W) + this->y * this->w);
+	this->embed_grid();
     this->set_next_grid();
 }
 
-void BPCSStreamBuf::save_im(){
-    uint_fast8_t k = N_CHANNELS * this->n_bitplanes;
-    uint_fast8_t i = N_CHANNELS -1;
-    
-    do {
-        // First bitplane (i.e. most significant bit) of each channel is unchanged by conversion to CGC
-		--k;
-		auto j = this->n_bitplanes - 1;
-		for (auto _i = 0;  _i < this->w * this->h;  ++_i)
-			this->channel_byteplanes[i][_i] = this->bitplanes[k][_i] << j;
-		--j;
-        do {
-            --k;
-			for (auto _i = 0;  _i < this->w * this->h;  ++_i)
-				this->channel_byteplanes[i][_i] |= this->bitplanes[k][_i] << j;
-        } while (j-- != 0);
-    } while (i-- != 0);
-    
-	static char formated_out_fp[MAX_FILE_PATH_LEN];
-	format_out_fp(this->out_fmt, this->img_fps[this->img_n], formated_out_fp);
-	this->merge_channels();
-	convert_from_cgc(this->img_data);
+template<class G>
+void BPCSStreamBuf<G>::save_im(){
+  #ifdef STATS
+	const stats::Timer timer(stats::ENCODE);
+  #endif
+  #ifdef TRACING
+	const trace::Span span("save_im", trace::Args{this->img_fps[this->img_n]});
+  #endif
+	this->write_back_dirty_grids();
 	
-	png::write(formated_out_fp, this->png_bg, this->img_data, this->w, this->h, this->n_bitplanes);
+  #if defined(ENCODE_TO_MEMORY)
+	png::write_to_memory(this->out_bufs[this->img_n], (this->has_png_bg) ? &this->png_bg : nullptr, this->img_data, this->w, this->h, this->n_bitplanes, this->write_policy, this->allocator);
+  #elif defined(PIPELINE_IMAGES)
+	// Hand the image over to the encoder, taking its previous buffer in exchange
+	if (this->encoder.joinable())
+		this->encoder.join();
+	format_out_fp(this->out_fmt, this->img_fps[this->img_n], this->out_fp);
+	std::swap(this->img_data,  this->prev_img_data);
+	this->encoder = std::thread([this,  png_bg = this->png_bg,  has_png_bg = this->has_png_bg,  w = this->w,  h = this->h,  n_bitplanes = this->n_bitplanes](){
+	  #ifdef STATS
+		const stats::Timer timer(stats::ENCODE);
+	  #endif
+		png::write(this->out_fp, (has_png_bg) ? &png_bg : nullptr, this->prev_img_data, w, h, n_bitplanes, this->write_policy, this->allocator);
+	  #ifdef STATS
+		stats::add_file_sz(stats::PNG_BYTES_OUT, this->out_fp);
+	  #endif
+	});
+  #else
+	format_out_fp(this->out_fmt, this->img_fps[this->img_n], this->out_fp);
+	png::write(this->out_fp, (this->has_png_bg) ? &this->png_bg : nullptr, this->img_data, this->w, this->h, this->n_bitplanes, this->write_policy, this->allocator);
+   #ifdef STATS
+	stats::add_file_sz(stats::PNG_BYTES_OUT, this->out_fp);
+   #endif
+  #endif
 }
 #endif
+
+
+#ifdef BAND_STREAMING
+// Also used by BandStreamBuf
+template void split_channels_range<true>(const uchar* const,  uchar* const[N_CHANNELS],  size_t,  const size_t);
+#endif
+
+#define INSTANTIATE(N) \
+	template class BPCSStreamBuf<Grid<N, N>>;
+FOR_EACH_GRID_SIZE(INSTANTIATE)
+#undef INSTANTIATE
@@ -1,14 +1,63 @@
 #pragma once
 
 #include "typedefs.hpp"
+#include "grid.hpp"
+#include "cpu.hpp" // for MULTIVERSIONED
 #include "png.hpp"
+#include "alloc.hpp"
+#ifdef PIPELINE_IMAGES
+# include <thread>
+#endif
+#if defined(COMPLEXITY_ENGINE_PACKED) || defined(EMBEDDOR)
+# include "packed.hpp"
+#endif
+#ifdef COMPLEXITY_ENGINE_BYTEPLANE
+# include "byteplane.hpp"
+#endif
+#ifdef COMPLEXITY_INDEX
+# include "bpcsidx.hpp"
+#endif
+#ifdef STATS
+# include "stats.hpp"
+#endif
+#ifdef TRACING
+# include "trace.hpp"
+#endif
+#ifdef DAEMON
+# include "vessel_cache.hpp"
+# include <memory> // for std::shared_ptr
+#endif
+#if defined(COMPLEXITY_ENGINE_PACKED) || defined(COMPLEXITY_ENGINE_BYTEPLANE)
+// The complexities of every grid of a bitplane are known before its grids are walked
+# define PRECALCULATED_COMPLEXITIES
+#endif
+#if defined(LIBBPCS) && (defined(PIPELINE_IMAGES) || defined(COMPLEXITY_INDEX) || !defined(COMPLEXITY_ENGINE_BYTEPLANE))
+# error "The library reads images from memory on the calling thread, and uses the byteplane complexity engine"
+#endif
+#if defined(DAEMON) && (defined(PIPELINE_IMAGES) || defined(COMPLEXITY_INDEX) || !defined(COMPLEXITY_ENGINE_BYTEPLANE) || !defined(EMBEDDOR) || !defined(PARALLEL_DEFLATE))
+# error "The daemon runs each job on its worker's thread, caches the complexities of the byteplane complexity engine, and encodes images into memory"
+#endif
+#if defined(EMBEDDOR) && (defined(LIBBPCS) || defined(DAEMON))
+// Output images are encoded into out_bufs, rather than written to files
+# define ENCODE_TO_MEMORY
+#endif
+#if defined(COMPLEXITY_ENGINE_BYTEPLANE) && !defined(ONLY_COUNT)
+// The complexities of every grid of an image are known at once, so the position of any grid of the stream can be found without walking the grids before it
+# define RANDOM_ACCESS
+#endif
 
-#define GRID_SZ (GRID_W * GRID_H)
-#define CONJUGATION_BIT_INDX (GRID_SZ - 1)
-#define BYTES_PER_GRID ((GRID_SZ - 1) / 8)
 
+template<bool is_cgc>
+void split_channels_range(const uchar* const img_data,  uchar* const channel_byteplanes[N_CHANNELS],  size_t i,  const size_t end);
+// Deinterleaves pixels [i, end) of img_data into channel_byteplanes, converting them to CGC if is_cgc
 
+
+template<class G>
 class BPCSStreamBuf {
+	// G is the Grid that data is embedded in
+  #ifdef BENCHMARK
+	friend class Bench; // Times the private stages of the stream
+  #endif
   public:
     /* Constructors */
     BPCSStreamBuf(const unsigned min_complexity,  int img_n,  int n_imgs,  char** im_fps
@@ -20,8 +69,19 @@ class BPCSStreamBuf {
                 #endif
                 ):
 	exhausted(false)
+	, allocator(&alloc::default_allocator)
+  #ifdef LIBBPCS
+	, img_bufs(nullptr)
+  #endif
+  #ifdef ENCODE_TO_MEMORY
+	, out_bufs(nullptr)
+  #endif
+  #ifdef DAEMON
+	, vessel_cache(nullptr)
+  #endif
   #ifdef EMBEDDOR
 	, embedding(emb)
+	, exhaustion_is_error(true)
 	, out_fmt(outfmt)
   #endif
 	, x(0)
@@ -31,15 +91,58 @@ class BPCSStreamBuf {
 	, img_n_offset(img_n)
 	, n_imgs(n_imgs)
 	, img_fps(im_fps)
+	, img_data(nullptr)
 	, img_data_sz(0)
+  #ifdef EMBEDDOR
+	, bitplanes()
+	, dirty_grids(nullptr)
+  #endif
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	, packed_bitplane(nullptr)
+	, complex_grids(nullptr)
+  #endif
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	, grid_complexities(nullptr)
+	, grid_complexities_sz(0)
+  #endif
+  #ifdef PIPELINE_IMAGES
+	, next_img_n(-1)
+	, next_img_data(nullptr)
+   #ifdef EMBEDDOR
+	, prev_img_data(nullptr)
+   #endif
+  #endif
+	, buffers(nullptr)
+  #ifdef STATS
+	, grid_counts()
+	, stats_img_n(-1)
+  #endif
+  #ifdef TRACING
+	, trace_bitplane_n(-1)
+  #endif
     {}
     
+	~BPCSStreamBuf();
+    
     
 	bool exhausted;
+	const bpcs_allocator* allocator; // Every buffer is allocated with this. Must not be changed once the first image is loaded.
+    
+  #ifdef LIBBPCS
+	const bpcs_vessel* img_bufs; // The images are decoded from these, rather than read from img_fps
+  #endif
+  #ifdef ENCODE_TO_MEMORY
+	bpcs_buf* out_bufs; // The images are encoded into these, rather than written to files
+  #endif
+  #ifdef DAEMON
+	VesselCache* vessel_cache; // If not nullptr, images are taken from this rather than decoded, unless they are not yet in it
+  #endif
     
     #ifdef EMBEDDOR
     const bool embedding;
+	bool exhaustion_is_error; // Whether to error when the embedded data does not fit. Set to false when the caller has already calculated how much will fit.
     char* out_fmt = NULL;
+	png::WritePolicy write_policy;
     #endif
     
 	void get(uchar* msg_arr);
@@ -47,18 +150,43 @@ class BPCSStreamBuf {
     
     
 	uchar* img_data; // Points to a contiguous portion of memory. The first section is as large as 3 sections, and stores the image pixels in RGBRGBRGB fashion (as decoded by LibPNG); the next 3 sections store each channel's byteplane; the last section stores the current bitplane.
-	size_t img_data_sz;
+	size_t img_data_sz; // Of img_data, and of each of the buffers that it is swapped with
 	
 	uint32_t w;
 	uint32_t h;
     
     void load_next_img(); // Init
+	void decode_img(const int n); // Reads the nth image into img_data, and splits it into channel_byteplanes
+    
+  #ifdef RANDOM_ACCESS
+	void seek(uint64_t grid_indx); // Loads the image containing the grid_indx-th grid of the stream, and makes it the current grid. Sets exhausted if the stream has fewer grids.
+  #endif
+    
+  #if defined(ENABLE_THREADS) || defined(LIBBPCS) || defined(DAEMON)
+	// For extracting the bitplanes of the current image in parallel. Bitplanes are indexed as (channel_n * n_bitplanes + bitplane_n).
+	size_t get_bitplane_sz(const int bitplane_indx) const; // Number of bytes that get_bitplane() writes
+	void get_bitplane(const int bitplane_indx,  uchar* msg_arr) const;
+	size_t get_img_sz() const; // Number of bytes that can be embedded in the current image
+  #endif
+    
+  #ifdef COMPLEXITY_INDEX
+	void write_complexity_index() const; // Writes the complexities of the current image to its index
+  #endif
+  #ifdef ONLY_COUNT
+	void add_to_histogram(uint64_t* histogram) const; // Counts the grids of each complexity in each bitplane of the current image. histogram holds (G::max_complexity + 1) counts for each bitplane, indexed as (channel_n * MAX_BITPLANES + bitplane_n).
+  #endif
     
     #ifdef EMBEDDOR
-    void put(uchar arr[BYTES_PER_GRID]);
+    void put(uchar arr[G::n_bytes]);
     void save_im(); // End
     #endif
+	int n_bitplanes;
+    
+    const int img_n_offset;
+    int n_imgs;
   private:
+	typedef typename G::complexity_typ complexity_typ;
+	
     int x; // the current grid is the (x-1)th grid horizontally and yth grid vertically (NOT the coordinates of the corner of the current grid of the current image)
     int y;
     
@@ -67,40 +195,123 @@ class BPCSStreamBuf {
     const unsigned min_complexity;
     
     uint8_t channel_n;
-	int n_bitplanes;
     uint8_t bitplane_n;
     
-    const int img_n_offset;
     int img_n;
-    int n_imgs;
     
-	uchar grid[GRID_SZ];
+	uchar grid[G::sz];
     
 	uchar* bitplane;
     
     #ifdef EMBEDDOR
-	uchar* bitplanes[MAX_BITPLANES];
+	uint64_t* bitplanes[MAX_BITPLANES]; // The bitplanes of the image, packed, indexed as (channel_n * n_bitplanes + bitplane_n). Only those up to the current one have been split out of the byteplanes.
+	uint64_t* dirty_grids; // Bitmap of the grids that have been embedded in, in any bitplane
     #endif
     
 	uchar* channel_byteplanes[N_CHANNELS];
     
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	uint64_t* packed_bitplane; // The current bitplane, each row packed into 64-bit words
+	uint64_t* complex_grids; // Bitmap of the grids of the current bitplane that have at least min_complexity
+  #endif
+  #if defined(COMPLEXITY_ENGINE_PACKED) || defined(EMBEDDOR)
+	size_t packed_row_sz; // Number of words per row of a packed bitplane
+  #endif
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	complexity_typ* grid_complexities; // The complexity of every grid of every bitplane of every channel of the image, as tables of n_grids elements
+	size_t grid_complexities_sz; // Number of elements allocated for grid_complexities
+	const complexity_typ* bitplane_complexities; // The table for the current bitplane
+  #endif
+  #if defined(PRECALCULATED_COMPLEXITIES) || defined(EMBEDDOR)
+	size_t n_grids_hrztl;
+	size_t n_grids;
+  #endif
+  #ifdef PRECALCULATED_COMPLEXITIES
+	size_t grid_n; // Index of the next grid of the current bitplane to consider
+	void* kernel_scratch; // Of the complexity kernel, whose rows are as wide as the image
+	size_t kernel_scratch_sz; // In bytes
+  #endif
+    
     #ifdef EMBEDDOR
-    png_color_16p png_bg;
+    png_color_16 png_bg;
+	bool has_png_bg;
+	char out_fp[MAX_FILE_PATH_LEN];
     #endif
     
+  #ifdef PIPELINE_IMAGES
+	// The image after the current one is decoded in the background, and the image before it is encoded and written in the background
+	std::thread decoder;
+	int next_img_n; // The image being decoded into next_img_data, or -1 if none
+	uchar* next_img_data;
+	uint32_t next_w;
+	uint32_t next_h;
+	int next_n_bitplanes;
+   #ifdef EMBEDDOR
+	png_color_16 next_png_bg;
+	bool next_has_png_bg;
+	
+	std::thread encoder;
+	uchar* prev_img_data; // The image being written by the encoder
+   #endif
+  #endif
+	
+	void* buffers; // The block that every buffer of the images is carved from, or nullptr until the first image is loaded
+	// The largest requirements of any of the images, which the buffers are sized for. img_data_sz and grid_complexities_sz are the others.
+  #if defined(COMPLEXITY_ENGINE_PACKED) || defined(EMBEDDOR)
+	size_t max_plane_sz; // Of a packed bitplane, in words
+  #endif
+	size_t max_n_grids;
+	int max_n_bitplanes;
+    
     char** img_fps;
     
-	void convert_to_cgc(uchar* arr);
-	void convert_from_cgc(uchar* arr);
+  #ifdef STATS
+	stats::GridCounts grid_counts;
+	int stats_img_n; // The image that grid_counts are of, or -1 if none
+	void add_img_stats(const bool is_walked); // Records the image that the stream is finishing with. is_walked is whether each of its grids has been walked.
+  #endif
+  #ifdef TRACING
+	int trace_bitplane_n; // Of the bitplane being walked, or -1 if none
+	uint64_t trace_bitplane_start_ns;
+	void trace_bitplane(const int bitplane_n); // Ends the event of the bitplane being walked, and begins that of bitplane_n unless it is -1
+  #endif
+    
+	void reserve_buffers(); // Allocates the buffers, for the largest of the images
+	void read_img(); // Decodes the current image, as decode_img does
+  #if defined(PIPELINE_IMAGES) || defined(MMAP_INPUT)
+	bool is_decode_needed(const int n) const; // Whether the nth image will be decoded, rather than only having its complexities read from its index, so is worth reading ahead
+  #endif
+	void set_channel_byteplanes(); // Points channel_byteplanes and bitplane into img_data, and sets the numbers of grids, for the current image's dimensions
+  #ifdef DAEMON
+	std::shared_ptr<const Vessel> to_vessel() const; // Copies the decoded current image
+	void load_vessel(const Vessel& vessel); // Makes a copy of a decoded image the current image
+  #endif
+    
     void set_next_grid();
     void load_next_bitplane();
     void load_next_channel();
 	void split_channels();
-	void merge_channels();
     
-	inline void byteplane_div2(uchar* arr);
 	void extract_grid(uchar* arr,  size_t indx);
-	void embed_grid(uchar* arr,  size_t indx);
+  #ifdef EMBEDDOR
+	void split_bitplane(); // Splits the current bitplane out of its byteplane
+	void embed_grid(); // Writes the current grid to the current bitplane
+	MULTIVERSIONED
+	void write_back_dirty_grids(); // Writes the modified grids back to the pixels
+  #endif
     inline void conjugate_grid();
     
+  #ifdef COMPLEXITY_ENGINE_PACKED
+	void scan_bitplane(const uchar* arr,  const unsigned bit_n);
+	void find_complex_grids(const uint64_t* plane);
+  #endif
+  #ifdef COMPLEXITY_ENGINE_BYTEPLANE
+	void calc_grid_complexities();
+   #ifdef COMPLEXITY_INDEX
+	bool read_complexity_index(); // Reads the complexities of the current image from its index, if it has a valid one
+   #endif
+	void extract_grid_bits(uchar* grid_itr,  const uchar* arr,  size_t indx,  const unsigned bit_n) const;
+	size_t count_complex_grids(const int bitplane_indx) const; // Number of grids of the bitplane that are embedded in. Bitplanes are indexed as (channel_n * n_bitplanes + bitplane_n).
+  #endif
+    
 };
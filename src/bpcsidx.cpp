@@ -0,0 +1,186 @@
+#include "bpcsidx.hpp"
+#include "errors.hpp"
+#include <compsky/macros/likely.hpp>
+#include <cstdio> // for fopen
+#include <cstring> // for memcpy
+#include <sys/stat.h>
+#ifdef MMAP_INPUT
+# include <fcntl.h> // for open
+# include <sys/mman.h>
+# include <unistd.h> // for close
+#endif
+
+
+namespace bpcsidx {
+
+
+constexpr static
+const char magic[8] = {'B', 'P', 'C', 'S', 'I', 'D', 'X', 0};
+constexpr static
+const uint32_t version = 2;
+
+
+static
+void get_index_fp(const char* const img_fp,  char index_fp[MAX_FILE_PATH_LEN]){
+	static constexpr const char ext[] = ".bpcsidx";
+	const size_t len = strlen(img_fp);
+	if (unlikely(len + sizeof(ext) > MAX_FILE_PATH_LEN))
+		handler(UNLIKELY_LONG_FILE_NAME);
+	memcpy(index_fp,  img_fp,  len);
+	memcpy(index_fp + len,  ext,  sizeof(ext));
+}
+
+
+static
+bool get_img_id(const char* const img_fp,  uint64_t& img_sz,  int64_t& img_mtime_ns){
+	// Identifies the contents of the image well enough to tell that it has changed, without reading it
+	struct stat st;
+	if (stat(img_fp, &st) != 0)
+		return false;
+	img_sz = st.st_size;
+	img_mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000  +  st.st_mtim.tv_nsec;
+	return true;
+}
+
+
+template<class G>
+static
+size_t get_n_complexities(const uint32_t w,  const uint32_t h,  const int n_bitplanes){
+	return N_CHANNELS * size_t(n_bitplanes) * (w / G::w) * (h / G::h);
+}
+
+
+template<class G>
+static
+void set_header(Header& hdr,  const uint32_t w,  const uint32_t h,  const int n_bitplanes,  const uint64_t img_sz,  const int64_t img_mtime_ns){
+	memset(&hdr,  0,  sizeof(hdr));
+	memcpy(hdr.magic,  magic,  sizeof(magic));
+	hdr.version = version;
+	hdr.grid_w = G::w;
+	hdr.grid_h = G::h;
+	hdr.n_channels = N_CHANNELS;
+	hdr.complexity_sz = sizeof(typename G::complexity_typ);
+	hdr.n_bitplanes = n_bitplanes;
+	hdr.w = w;
+	hdr.h = h;
+	hdr.img_sz = img_sz;
+	hdr.img_mtime_ns = img_mtime_ns;
+}
+
+
+template<class G>
+static
+size_t get_valid_n_complexities(const Header& hdr,  const size_t index_sz,  const uint64_t img_sz,  const int64_t img_mtime_ns,  const size_t complexities_sz){
+	// Returns the number of complexities that follow the header, or 0 if the index is not valid for the image
+	Header expected_hdr;
+	set_header<G>(expected_hdr,  hdr.w,  hdr.h,  hdr.n_bitplanes,  img_sz,  img_mtime_ns);
+	if ((memcmp(&hdr, &expected_hdr, sizeof(hdr)) != 0)  or  (hdr.n_bitplanes > MAX_BITPLANES))
+		return 0;
+	const size_t sz = get_n_complexities<G>(hdr.w, hdr.h, hdr.n_bitplanes);
+	if ((sz > complexities_sz)  or  (index_sz != sizeof(Header) + sz * sizeof(typename G::complexity_typ)))
+		return 0;
+	return sz;
+}
+
+
+template<class G>
+bool read(const char* const img_fp,  uint32_t& w,  uint32_t& h,  int& n_bitplanes,  typename G::complexity_typ* const complexities,  const size_t complexities_sz){
+	typedef typename G::complexity_typ complexity_typ;
+	uint64_t img_sz;
+	int64_t img_mtime_ns;
+	if (not get_img_id(img_fp, img_sz, img_mtime_ns))
+		return false;
+	char index_fp[MAX_FILE_PATH_LEN];
+	get_index_fp(img_fp, index_fp);
+
+	size_t sz = 0;
+	Header hdr;
+  #ifdef MMAP_INPUT
+	const int fd = open(index_fp, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	const bool is_big_enough = (fstat(fd, &st) == 0)  and  (size_t(st.st_size) >= sizeof(Header));
+	void* const buf = (is_big_enough) ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (buf == MAP_FAILED)
+		return false;
+	memcpy(&hdr,  buf,  sizeof(hdr));
+	sz = get_valid_n_complexities<G>(hdr, st.st_size, img_sz, img_mtime_ns, complexities_sz);
+	memcpy(complexities,  (const uchar*)buf + sizeof(Header),  sz * sizeof(complexity_typ));
+	munmap(buf, st.st_size);
+  #else
+	struct stat st;
+	if (stat(index_fp, &st) != 0)
+		return false;
+	FILE* const f = fopen(index_fp, "rb");
+	if (f == nullptr)
+		return false;
+	if (fread(&hdr, sizeof(hdr), 1, f) == 1){
+		sz = get_valid_n_complexities<G>(hdr, st.st_size, img_sz, img_mtime_ns, complexities_sz);
+		if (fread(complexities, sizeof(complexity_typ), sz, f) != sz)
+			sz = 0;
+	}
+	fclose(f);
+  #endif
+	if (sz == 0)
+		return false;
+	w = hdr.w;
+	h = hdr.h;
+	n_bitplanes = hdr.n_bitplanes;
+	return true;
+}
+
+
+template<class G>
+bool is_valid(const char* const img_fp,  const size_t complexities_sz){
+	uint64_t img_sz;
+	int64_t img_mtime_ns;
+	if (not get_img_id(img_fp, img_sz, img_mtime_ns))
+		return false;
+	char index_fp[MAX_FILE_PATH_LEN];
+	get_index_fp(img_fp, index_fp);
+
+	struct stat st;
+	if (stat(index_fp, &st) != 0)
+		return false;
+	FILE* const f = fopen(index_fp, "rb");
+	if (f == nullptr)
+		return false;
+	Header hdr;
+	const bool is_read = (fread(&hdr, sizeof(hdr), 1, f) == 1);
+	fclose(f);
+	return (is_read)  and  (get_valid_n_complexities<G>(hdr, st.st_size, img_sz, img_mtime_ns, complexities_sz) != 0);
+}
+
+
+template<class G>
+void write(const char* const img_fp,  const uint32_t w,  const uint32_t h,  const int n_bitplanes,  const typename G::complexity_typ* const complexities){
+	uint64_t img_sz;
+	int64_t img_mtime_ns;
+	if (unlikely(not get_img_id(img_fp, img_sz, img_mtime_ns)))
+		handler(COULD_NOT_STAT_FILE);
+	Header hdr;
+	set_header<G>(hdr,  w,  h,  n_bitplanes,  img_sz,  img_mtime_ns);
+
+	char index_fp[MAX_FILE_PATH_LEN];
+	get_index_fp(img_fp, index_fp);
+	FILE* const f = fopen(index_fp, "wb");
+	if (unlikely(f == nullptr))
+		handler(CANNOT_CREATE_FILE);
+	const size_t sz = get_n_complexities<G>(w, h, n_bitplanes);
+	if (unlikely((fwrite(&hdr, sizeof(hdr), 1, f) != 1)  or  (fwrite(complexities, sizeof(typename G::complexity_typ), sz, f) != sz)))
+		handler(CANNOT_CREATE_FILE);
+	fclose(f);
+}
+
+
+#define INSTANTIATE(N) \
+	template bool read<Grid<N, N>>(const char* const,  uint32_t&,  uint32_t&,  int&,  Grid<N, N>::complexity_typ* const,  const size_t); \
+	template bool is_valid<Grid<N, N>>(const char* const,  const size_t); \
+	template void write<Grid<N, N>>(const char* const,  const uint32_t,  const uint32_t,  const int,  const Grid<N, N>::complexity_typ* const);
+FOR_EACH_GRID_SIZE(INSTANTIATE)
+#undef INSTANTIATE
+
+
+} // namespace bpcsidx
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "typedefs.hpp"
+#include "byteplane.hpp"
+
+
+/*
+ * Complexity index sidecars
+ * The complexity of every grid of every bitplane of a vessel image is stored next to it, in "<image path>.bpcsidx", so that it need not be calculated again.
+ * The file is a Header followed by the complexity tables, exactly as byteplane::get_grid_complexities writes them for each channel in turn, so it is memory-mapped and copied straight into the complexity buffer.
+ * The index is only used if the image has the same size and modification time as when it was indexed, and if it was made with the same grid size and number of channels. The image itself is not read.
+ */
+
+
+namespace bpcsidx {
+
+
+struct Header {
+	char magic[8];
+	uint32_t version; // Also differs if the index was written on a machine of different endianness
+	uint16_t grid_w;
+	uint16_t grid_h;
+	uint8_t n_channels;
+	uint8_t complexity_sz; // sizeof(G::complexity_typ)
+	uint8_t n_bitplanes;
+	uint8_t _padding;
+	uint32_t w;
+	uint32_t h;
+	uint64_t img_sz; // Of the image file
+	int64_t img_mtime_ns; // Of the image file
+};
+
+template<class G>
+bool read(const char* const img_fp,  uint32_t& w,  uint32_t& h,  int& n_bitplanes,  typename G::complexity_typ* const complexities,  const size_t complexities_sz);
+// Returns false if there is no valid index for the image, or if it has more complexities than complexities has room for (complexities_sz elements). Otherwise sets the dimensions of the image, and reads its complexities into complexities.
+
+template<class G>
+bool is_valid(const char* const img_fp,  const size_t complexities_sz);
+// Whether read would succeed, which only reads the header of the index
+
+template<class G>
+void write(const char* const img_fp,  const uint32_t w,  const uint32_t h,  const int n_bitplanes,  const typename G::complexity_typ* const complexities);
+
+
+} // namespace bpcsidx
@@ -0,0 +1,100 @@
+#include "byteplane.hpp"
+#include "cpu.hpp"
+#include <cstring> // for memset
+
+
+namespace byteplane {
+
+
+struct SpreadTable {
+	// Maps a byte to a word whose nth byte is the nth bit of the byte.
+	// Summing the spread XORs of neighbouring elements therefore sums the changes in every bitplane at once.
+	uint64_t arr[256];
+
+	constexpr
+	SpreadTable()
+	: arr()
+	{
+		for (unsigned i = 0;  i < 256;  ++i)
+			for (unsigned n = 0;  n < 8;  ++n)
+				this->arr[i] |= uint64_t((i >> n) & 1) << (8*n);
+	}
+};
+
+constexpr static
+const SpreadTable spread;
+
+
+template<class G>
+MULTIVERSIONED
+void get_grid_complexities(const uchar* byteplane,  const uint32_t w,  const uint32_t h,  const int n_bitplanes,  typename G::complexity_typ* complexities,  void* scratch){
+	typedef typename G::complexity_typ complexity_typ;
+	// The lanes could overflow within a grid, in which case they are emptied into totals after every row
+	constexpr bool is_lane_overflowable = (G::max_complexity > 255);
+	const size_t n_grids_hrztl = w / G::w;
+	const size_t n_grids_vrtcl = h / G::h;
+	const size_t n_grids = n_grids_hrztl * n_grids_vrtcl;
+	const int n_byte_bitplanes = (n_bitplanes < 8) ? n_bitplanes : 8;
+
+	// Laid out as get_scratch_sz describes
+	uint64_t* const lanes = (uint64_t*)scratch; // Byte n of lanes[i] is the complexity so far of the ith grid in bitplane n
+	uint16_t* const totals = (uint16_t*)(lanes + n_grids_hrztl);
+	uchar* const hrztl = (uchar*)(totals  +  ((is_lane_overflowable) ? 8 * n_grids_hrztl : 0)); // Each element XORed with its right neighbour
+	uchar* const vrtcl = hrztl + w; // Each element XORed with the element below it
+
+	for (size_t gy = 0;  gy < n_grids_vrtcl;  ++gy){
+		memset(lanes,  0,  n_grids_hrztl * sizeof(uint64_t));
+		if constexpr (is_lane_overflowable)
+			memset(totals,  0,  8 * n_grids_hrztl * sizeof(uint16_t));
+		const uchar* row = byteplane + gy * G::h * w;
+		for (unsigned j = 0;  j < G::h;  ++j){
+			for (uint32_t i = 0;  i < w - 1;  ++i)
+				hrztl[i] = row[i] ^ row[i + 1];
+			const bool has_row_below = (j != G::h - 1);
+			if (has_row_below)
+				for (uint32_t i = 0;  i < w;  ++i)
+					vrtcl[i] = row[i] ^ row[i + w];
+
+			for (size_t gx = 0;  gx < n_grids_hrztl;  ++gx){
+				uint64_t acc = lanes[gx];
+				for (unsigned i = 0;  i < G::w - 1;  ++i)
+					acc += spread.arr[hrztl[gx * G::w + i]];
+				if (has_row_below)
+					for (unsigned i = 0;  i < G::w;  ++i)
+						acc += spread.arr[vrtcl[gx * G::w + i]];
+				lanes[gx] = acc;
+			}
+			if constexpr (is_lane_overflowable){
+				for (size_t gx = 0;  gx < n_grids_hrztl;  ++gx){
+					for (unsigned n = 0;  n < 8;  ++n)
+						totals[8*gx + n] += (lanes[gx] >> (8*n)) & 0xff;
+					lanes[gx] = 0;
+				}
+			}
+			row += w;
+		}
+
+		for (int n = 0;  n < n_byte_bitplanes;  ++n){
+			complexity_typ* const table = complexities  +  n * n_grids  +  gy * n_grids_hrztl;
+			for (size_t gx = 0;  gx < n_grids_hrztl;  ++gx){
+				if constexpr (is_lane_overflowable)
+					table[gx] = totals[8*gx + n];
+				else
+					table[gx] = (lanes[gx] >> (8*n)) & 0xff;
+			}
+		}
+	}
+
+	// Bitplanes deeper than a byte are empty
+	for (int n = n_byte_bitplanes;  n < n_bitplanes;  ++n)
+		memset(complexities + n * n_grids,  0,  n_grids * sizeof(complexity_typ));
+}
+
+
+#define INSTANTIATE(N) \
+	template void get_grid_complexities<Grid<N, N>>(const uchar*,  const uint32_t,  const uint32_t,  const int,  Grid<N, N>::complexity_typ*,  void*);
+FOR_EACH_GRID_SIZE(INSTANTIATE)
+#undef INSTANTIATE
+
+
+} // namespace byteplane
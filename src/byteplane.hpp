@@ -0,0 +1,26 @@
+#pragma once
+
+#include "typedefs.hpp"
+#include "grid.hpp"
+
+
+namespace byteplane {
+
+
+template<class G>
+inline
+size_t get_scratch_sz(const uint32_t w){
+	// Bytes of scratch space that get_grid_complexities needs for a byteplane of width w: the complexities so far of a row of grids, then two rows of elements
+	const size_t n_grids_hrztl = w / G::w;
+	const size_t n_totals = (G::max_complexity > 255) ? 8 * n_grids_hrztl : 0;
+	return n_grids_hrztl * sizeof(uint64_t)  +  n_totals * sizeof(uint16_t)  +  2 * size_t(w);
+}
+
+template<class G>
+void get_grid_complexities(const uchar* byteplane,  const uint32_t w,  const uint32_t h,  const int n_bitplanes,  typename G::complexity_typ* complexities,  void* scratch);
+// Calculates the complexity of every grid of every bitplane of the byteplane, in a single pass over the byteplane.
+// Writes n_bitplanes tables, each of (w/G::w)*(h/G::h) elements ordered as the grids are walked (left to right, top to bottom). The nth table holds the complexities of bitplane n (bitplane 0 being the least significant bit).
+// scratch is get_scratch_sz<G>(w) bytes aligned to 8 bytes, which are overwritten. It is given by the caller, rather than kept on the stack, as it is as wide as the image.
+
+
+} // namespace byteplane
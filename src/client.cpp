@@ -0,0 +1,141 @@
+#include "daemon.hpp"
+#include "utils.hpp" // for format_out_fp
+#include <compsky/macros/likely.hpp>
+#include <cstdio> // for fopen
+#include <cstring> // for strlen
+#include <vector>
+#include <unistd.h>
+#include <sys/un.h> // for sockaddr_un
+
+
+namespace bpcsd {
+
+
+constexpr static
+const size_t buf_sz = 64 * 1024;
+
+
+static
+size_t read_from_stdin(uchar* const buf){
+	while(true){
+		const ssize_t n_read = read(STDIN_FILENO, buf, buf_sz);
+		if (likely(n_read != -1))
+			return n_read;
+		if (unlikely(errno != EINTR))
+			handler(CANNOT_READ_FROM_STDIN);
+	}
+}
+
+static
+void write_to_stdout(const uchar* itr,  size_t n){
+	while (n != 0){
+		const ssize_t n_writ = write(STDOUT_FILENO, itr, n);
+		if (unlikely(n_writ == -1)){
+			if (errno == EINTR)
+				continue;
+			handler(COULD_NOT_WRITE_ENOUGH_BYTES_TO_STDOUT);
+		}
+		itr += n_writ;
+		n -= n_writ;
+	}
+}
+
+
+int run_job(const char* const socket_path,  const uint32_t job,  const unsigned min_complexity,  const int img_n_offset,  const int n_imgs,  char** const img_fps,  char* const out_fmt,  const int level,  const int filter){
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (unlikely(strlen(socket_path) >= sizeof(addr.sun_path)))
+		handler(COULD_NOT_CONNECT_TO_DAEMON);
+	strcpy(addr.sun_path, socket_path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (unlikely((fd == -1)  or  (connect(fd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) != 0)))
+		handler(COULD_NOT_CONNECT_TO_DAEMON);
+
+	const Request request = {
+		{magic[0], magic[1], magic[2], magic[3]},
+		protocol_version,
+		job,
+		min_complexity,
+		uint32_t(n_imgs - img_n_offset),
+		level,
+		filter
+	};
+	send_n_bytes(fd, &request, sizeof(request));
+
+	// The daemon need not share the working directory, so relative paths are sent with it prepended
+	char cwd[MAX_FILE_PATH_LEN];
+	if (unlikely(getcwd(cwd, sizeof(cwd)) == nullptr))
+		cwd[0] = 0;
+	const uint32_t cwd_len = strlen(cwd);
+	for (int i = img_n_offset;  i < n_imgs;  ++i){
+		const char* const fp = img_fps[i];
+		const bool is_relative = (fp[0] != '/');
+		const uint32_t fp_len = strlen(fp);
+		const uint32_t len = (is_relative) ? (cwd_len + 1 + fp_len) : fp_len;
+		send_n_bytes(fd, &len, sizeof(len));
+		if (is_relative){
+			send_n_bytes(fd, cwd, cwd_len);
+			send_n_bytes(fd, "/", 1);
+		}
+		send_n_bytes(fd, fp, fp_len);
+	}
+
+	std::vector<uchar> buf(buf_sz);
+	if (job == JOB_EMBED){
+		// The daemon reads the whole stream before replying, even if it cannot all be embedded, so this cannot block on a reply
+		while(true){
+			const size_t n_bytes = read_from_stdin(buf.data());
+			if (n_bytes == 0)
+				break;
+			send_n_bytes(fd, buf.data(), n_bytes);
+		}
+		shutdown(fd, SHUT_WR);
+	}
+
+	while(true){
+		Frame frame;
+		recv_n_bytes(fd, &frame, sizeof(frame));
+		switch(frame.type){
+			case FRAME_DATA:
+				while (frame.sz != 0){
+					const size_t n_bytes = (frame.sz < buf_sz) ? frame.sz : buf_sz;
+					recv_n_bytes(fd, buf.data(), n_bytes);
+					write_to_stdout(buf.data(), n_bytes);
+					frame.sz -= n_bytes;
+				}
+				break;
+			case FRAME_IMG: {
+				// Written where the program would have written it
+				if (unlikely((out_fmt == nullptr)  or  (frame.arg >= request.n_imgs)))
+					handler(DAEMON_PROTOCOL_ERROR);
+				char out_fp[MAX_FILE_PATH_LEN];
+				format_out_fp(out_fmt,  img_fps[img_n_offset + frame.arg],  out_fp);
+				FILE* const png_file = fopen(out_fp, "wb");
+				if (unlikely(png_file == nullptr))
+					handler(COULD_NOT_OPEN_PNG_FILE);
+				while (frame.sz != 0){
+					const size_t n_bytes = (frame.sz < buf_sz) ? frame.sz : buf_sz;
+					recv_n_bytes(fd, buf.data(), n_bytes);
+					if (unlikely(fwrite(buf.data(), n_bytes, 1, png_file) != 1))
+						handler(PNG_ERROR_4);
+					frame.sz -= n_bytes;
+				}
+				fclose(png_file);
+				break;
+			}
+			case FRAME_END:
+				close(fd);
+				if (unlikely(frame.arg >= N_ERRORS))
+					frame.arg = DAEMON_PROTOCOL_ERROR;
+				if (frame.arg != NAH_NO_ERROR)
+					handler(frame.arg);
+				return frame.arg;
+			default:
+				handler(DAEMON_PROTOCOL_ERROR);
+				return DAEMON_PROTOCOL_ERROR;
+		}
+	}
+}
+
+
+} // namespace bpcsd
@@ -0,0 +1,71 @@
+#include "cpu.hpp"
+
+
+namespace cpu {
+
+
+const char* get_kernels_level(){
+  #ifdef CPU_DISPATCH
+	// In the order that the resolvers of MULTIVERSIONED functions try them
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("x86-64-v4"))
+		return "x86-64-v4";
+	if (__builtin_cpu_supports("x86-64-v3"))
+		return "x86-64-v3";
+	if (__builtin_cpu_supports("x86-64-v2"))
+		return "x86-64-v2";
+	return "x86-64";
+  #else
+	return "compiled";
+  #endif
+}
+
+
+void print_features(FILE* const f){
+  #if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	fprintf(f, "cpu:");
+	#define PRINT_IF_SUPPORTED(name) \
+		if (__builtin_cpu_supports(name)) \
+			fprintf(f, " " name);
+	PRINT_IF_SUPPORTED("sse2")
+	PRINT_IF_SUPPORTED("ssse3")
+	PRINT_IF_SUPPORTED("sse4.2")
+	PRINT_IF_SUPPORTED("popcnt")
+	PRINT_IF_SUPPORTED("avx2")
+	PRINT_IF_SUPPORTED("bmi2")
+	PRINT_IF_SUPPORTED("avx512f")
+	PRINT_IF_SUPPORTED("avx512bw")
+	#undef PRINT_IF_SUPPORTED
+	fprintf(f, "\ncompiled for:");
+   #ifdef __SSE2__
+	fprintf(f, " sse2");
+   #endif
+   #ifdef __SSSE3__
+	fprintf(f, " ssse3");
+   #endif
+   #ifdef __SSE4_2__
+	fprintf(f, " sse4.2");
+   #endif
+   #ifdef __POPCNT__
+	fprintf(f, " popcnt");
+   #endif
+   #ifdef __AVX2__
+	fprintf(f, " avx2");
+   #endif
+   #ifdef __BMI2__
+	fprintf(f, " bmi2");
+   #endif
+   #ifdef __AVX512F__
+	fprintf(f, " avx512f");
+   #endif
+   #ifdef __AVX512BW__
+	fprintf(f, " avx512bw");
+   #endif
+	fprintf(f, "\n");
+  #endif
+	fprintf(f, "kernels: %s\n", get_kernels_level());
+}
+
+
+} // namespace cpu
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdio>
+
+
+/*
+ * The instruction sets that the kernels are run with
+ * A build without NATIVE_MARCH can only assume those of the first x86-64 CPUs. With CPU_DISPATCH, the kernels marked MULTIVERSIONED are instead compiled once for each x86-64 microarchitecture level, and the best that the CPU supports is picked by the dynamic linker when the program starts, after which calls to them cost no more than any other call to a shared library.
+ * The kernels written with intrinsics are compiled for the instruction set they need, and check for it themselves.
+ */
+
+
+#ifdef CPU_DISPATCH
+# define MULTIVERSIONED  __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "arch=x86-64-v2", "default")))
+# define TARGET_SSSE3  __attribute__((target("ssse3")))
+# define ALWAYS_INLINE  __attribute__((always_inline)) // For the helpers of MULTIVERSIONED kernels, which would otherwise only inline functions compiled for the same CPU
+#else
+# define MULTIVERSIONED
+# define TARGET_SSSE3
+# define ALWAYS_INLINE
+#endif
+
+
+namespace cpu {
+
+
+inline
+bool has_ssse3(){
+  #if defined(__SSSE3__)
+	return true;
+  #elif defined(CPU_DISPATCH)
+	return __builtin_cpu_supports("ssse3");
+  #else
+	return false;
+  #endif
+}
+
+
+const char* get_kernels_level();
+// The x86-64 level whose build of the MULTIVERSIONED kernels is run, or "compiled" if they are only built for the instruction sets the program was compiled for
+
+void print_features(FILE* const f);
+// Writes the instruction sets that the CPU supports, those that the program was compiled for, and the kernels level
+
+
+} // namespace cpu
@@ -0,0 +1,306 @@
+#include "daemon.hpp"
+#include "bpcs.hpp"
+#include "os.hpp" // for io_buf_sz
+#include "errors.hpp"
+#include "alloc.hpp"
+#include "vessel_cache.hpp"
+#include <compsky/macros/likely.hpp>
+#define LIBCOMPSKY_NO_TESTS
+#include <compsky/deasciify/a2n.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstdio> // for snprintf
+#include <cstring> // for memcmp
+#include <memory> // for std::unique_ptr
+#include <new> // for std::bad_alloc
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h> // for umask
+#include <sys/un.h> // for sockaddr_un
+
+
+#ifndef DAEMON_CACHE_SZ
+# define DAEMON_CACHE_SZ 256
+#endif
+
+
+/*
+ * bpcsd - carries out the jobs that bpcs, bpcs-x and bpcs-count send it over a Unix socket, when given -S (see bpcsd(1))
+ * Each of a fixed number of workers takes one connection at a time. Each worker's buffers are kept from job to job by its Pool, and the workers share the decoded vessels through a VesselCache.
+ */
+
+
+class Worker {
+  public:
+	explicit
+	Worker(VesselCache& cache)
+	: cache(cache)
+	{}
+
+	void serve(const int fd); // Carries out the job sent over the connection, and closes it
+
+  private:
+	VesselCache& cache;
+	alloc::Pool pool;
+	uchar io_buf[io_buf_sz<DefaultGrid>];
+
+	// Of the current job
+	int fd;
+	bpcsd::Request request;
+	bool is_stream_read; // Whether the stream to embed has been read up to its end
+	std::vector<std::string> fps;
+	std::vector<char*> img_fps;
+	std::vector<bpcs_buf> out_bufs;
+
+	void run_job();
+	void read_img_fps();
+	void extract(BPCSStreamBuf<DefaultGrid>& bpcs_stream);
+	void embed(BPCSStreamBuf<DefaultGrid>& bpcs_stream);
+	void count(BPCSStreamBuf<DefaultGrid>& bpcs_stream);
+	void send_frame(const uint32_t type,  const uint32_t arg,  const void* const data,  const size_t sz);
+};
+
+
+void Worker::serve(const int fd){
+	this->fd = fd;
+	this->request.job = bpcsd::N_JOBS;
+	this->is_stream_read = false;
+	int rc = NAH_NO_ERROR;
+	try {
+		this->run_job();
+	} catch (const Error& e){
+		rc = e.rc;
+	} catch (const std::bad_alloc&){
+		rc = OOM;
+	}
+	try {
+		if ((this->request.job == bpcsd::JOB_EMBED)  and  (not this->is_stream_read))
+			// The client sends the whole stream before it reads the reply
+			while (bpcsd::recv_up_to_n_bytes(this->fd, this->io_buf, io_buf_sz<DefaultGrid>) == io_buf_sz<DefaultGrid>);
+		// Including those embedded in before an error, as the program would have written them
+		for (size_t i = 0;  i < this->out_bufs.size();  ++i)
+			if (this->out_bufs[i].data != nullptr)
+				this->send_frame(bpcsd::FRAME_IMG,  i,  this->out_bufs[i].data,  this->out_bufs[i].sz);
+		this->send_frame(bpcsd::FRAME_END,  rc,  nullptr,  0);
+	} catch (const Error&){
+		// The client has gone away
+	}
+	for (const bpcs_buf& buf : this->out_bufs)
+		alloc::free(&this->pool.allocator, buf.data);
+	this->out_bufs.clear();
+	close(fd);
+}
+
+
+void Worker::run_job(){
+	bpcsd::recv_n_bytes(this->fd, &this->request, sizeof(this->request));
+	if (unlikely((memcmp(this->request.magic, bpcsd::magic, sizeof(bpcsd::magic)) != 0)  or  (this->request.version != bpcsd::protocol_version)  or  (this->request.job >= bpcsd::N_JOBS)  or  (this->request.n_imgs > bpcsd::max_n_imgs))){
+		this->request.job = bpcsd::N_JOBS;
+		handler(DAEMON_PROTOCOL_ERROR);
+	}
+	this->read_img_fps();
+
+	BPCSStreamBuf<DefaultGrid> bpcs_stream(this->request.min_complexity,  0,  this->request.n_imgs,  this->img_fps.data(),  (this->request.job == bpcsd::JOB_EMBED),  nullptr);
+	bpcs_stream.allocator = &this->pool.allocator;
+	bpcs_stream.vessel_cache = &this->cache;
+	switch(this->request.job){
+		case bpcsd::JOB_EXTRACT:
+			this->extract(bpcs_stream);
+			break;
+		case bpcsd::JOB_EMBED:
+			this->embed(bpcs_stream);
+			break;
+		case bpcsd::JOB_COUNT:
+			this->count(bpcs_stream);
+			break;
+	}
+}
+
+
+void Worker::read_img_fps(){
+	this->fps.resize(this->request.n_imgs);
+	this->img_fps.resize(this->request.n_imgs);
+	for (uint32_t i = 0;  i < this->request.n_imgs;  ++i){
+		uint32_t len;
+		bpcsd::recv_n_bytes(this->fd, &len, sizeof(len));
+		if (unlikely(len >= MAX_FILE_PATH_LEN))
+			handler(UNLIKELY_LONG_FILE_NAME);
+		std::string& fp = this->fps[i];
+		fp.resize(len);
+		bpcsd::recv_n_bytes(this->fd, &fp[0], len);
+		this->img_fps[i] = &fp[0];
+	}
+}
+
+
+void Worker::extract(BPCSStreamBuf<DefaultGrid>& bpcs_stream){
+	// Extracts each image at once, as extract_to_stdout_threaded does, and sends it as a frame
+	std::unique_ptr<uchar, alloc::Deleter> buf(nullptr,  alloc::Deleter{bpcs_stream.allocator});
+	size_t buf_sz = 0;
+	for (int img_n = 0;  img_n != bpcs_stream.n_imgs;  ++img_n){
+		bpcs_stream.decode_img(img_n);
+		const size_t sz = bpcs_stream.get_img_sz();
+		if (sz > buf_sz){
+			uchar* const new_buf = (uchar*)alloc::realloc(bpcs_stream.allocator, buf.get(), sz);
+			if (unlikely(new_buf == nullptr))
+				handler(OOM);
+			buf.release();
+			buf.reset(new_buf);
+			buf_sz = sz;
+		}
+		size_t offset = 0;
+		for (int i = 0;  i < N_CHANNELS * bpcs_stream.n_bitplanes;  ++i){
+			bpcs_stream.get_bitplane(i,  buf.get() + offset);
+			offset += bpcs_stream.get_bitplane_sz(i);
+		}
+		this->send_frame(bpcsd::FRAME_DATA,  0,  buf.get(),  sz);
+	}
+}
+
+
+void Worker::embed(BPCSStreamBuf<DefaultGrid>& bpcs_stream){
+	// As embed_from_stdin, with the stream read from the client
+	if (unlikely((this->request.level < 0)  or  (this->request.level > 9)  or  (this->request.filter < 0)  or  (this->request.filter > png::FILTER_ALL)))
+		handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	bpcs_stream.write_policy.level = this->request.level;
+	bpcs_stream.write_policy.filter = this->request.filter;
+	// Compressed on the worker's thread, which is where handler() must throw from. The other workers are busy with other jobs.
+	bpcs_stream.write_policy.n_threads = 1;
+	this->out_bufs.assign(this->request.n_imgs,  bpcs_buf{nullptr, 0});
+	bpcs_stream.out_bufs = this->out_bufs.data();
+
+	bpcs_stream.load_next_img();
+	while(true){
+		const size_t n_bytes = bpcsd::recv_up_to_n_bytes(this->fd, this->io_buf, io_buf_sz<DefaultGrid>);
+		uchar* io_buf_itr = this->io_buf;
+		uchar* const io_buf_end = this->io_buf  +  (n_bytes / DefaultGrid::n_bytes) * DefaultGrid::n_bytes;
+		for (;  io_buf_itr != io_buf_end;  io_buf_itr += DefaultGrid::n_bytes)
+			bpcs_stream.put(io_buf_itr);
+		if (n_bytes != io_buf_sz<DefaultGrid>){
+			this->is_stream_read = true;
+			// The final grid is padded with zeros, so is entirely zeros if the stream ended on a grid boundary
+			const size_t n_bytes_left = n_bytes % DefaultGrid::n_bytes;
+			memset(io_buf_itr + n_bytes_left,  0,  DefaultGrid::n_bytes - n_bytes_left);
+			bpcs_stream.put(io_buf_itr);
+			break;
+		}
+	}
+	bpcs_stream.save_im();
+}
+
+
+void Worker::count(BPCSStreamBuf<DefaultGrid>& bpcs_stream){
+	uint64_t n = 0;
+	for (int img_n = 0;  img_n != bpcs_stream.n_imgs;  ++img_n){
+		bpcs_stream.decode_img(img_n);
+		n += bpcs_stream.get_img_sz();
+	}
+	char str[24];
+	const int len = snprintf(str, sizeof(str), "%lu\n", n);
+	this->send_frame(bpcsd::FRAME_DATA,  0,  str,  len);
+}
+
+
+void Worker::send_frame(const uint32_t type,  const uint32_t arg,  const void* const data,  const size_t sz){
+	const bpcsd::Frame frame = {sz, type, arg};
+	bpcsd::send_n_bytes(this->fd, &frame, sizeof(frame));
+	bpcsd::send_n_bytes(this->fd, data, sz);
+}
+
+
+static
+int listen_on(const char* const socket_path){
+	// Replaces any socket left by a previous daemon. Only the daemon's user may connect, as the daemon reads whatever files it is sent.
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (unlikely(strlen(socket_path) >= sizeof(addr.sun_path)))
+		handler(COULD_NOT_LISTEN_ON_SOCKET);
+	strcpy(addr.sun_path, socket_path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (unlikely(fd == -1))
+		handler(COULD_NOT_LISTEN_ON_SOCKET);
+	unlink(socket_path);
+	const mode_t prev_umask = umask(0077);
+	const bool is_bound = (bind(fd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) == 0);
+	umask(prev_umask);
+	if (unlikely((not is_bound)  or  (listen(fd, SOMAXCONN) != 0)))
+		handler(COULD_NOT_LISTEN_ON_SOCKET);
+	return fd;
+}
+
+
+static
+int run(const int argc,  char* argv[]){
+	unsigned n_workers = std::thread::hardware_concurrency();
+	size_t cache_sz = DAEMON_CACHE_SZ; // MiB
+	int i = 0;
+	while ((i + 1 < argc)  and  (argv[i+1][0] == '-')){
+		const char* const arg = argv[++i];
+		if (unlikely((arg[2] != 0)  or  (i + 1 == argc)))
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+		switch(arg[1]){
+			case 'j':
+				n_workers = a2n<unsigned>(argv[++i]);
+				break;
+			case 'c':
+				cache_sz = a2n<size_t>(argv[++i]);
+				break;
+			default:
+				handler(WRONG_ARGUMENTS_TO_PROGRAM);
+		}
+	}
+	if (unlikely(i + 2 != argc))
+		handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	if (n_workers == 0)
+		n_workers = 1;
+
+	const int listen_fd = listen_on(argv[i + 1]);
+	VesselCache cache(cache_sz * 1024 * 1024);
+	std::vector<std::thread> workers;
+	for (unsigned n = 0;  n < n_workers;  ++n){
+		workers.emplace_back([listen_fd, &cache](){
+			const std::unique_ptr<Worker> worker(new Worker(cache));
+			while(true){
+				const int fd = accept(listen_fd, nullptr, nullptr);
+				if (unlikely(fd == -1)){
+					switch(errno){
+						case EINTR:
+						case ECONNABORTED:
+							// The connection was lost before it was accepted
+							continue;
+						case EMFILE:
+						case ENFILE:
+						case ENOBUFS:
+						case ENOMEM:
+							// Wait for other connections to close
+							std::this_thread::sleep_for(std::chrono::milliseconds(100));
+							continue;
+						default:
+							// The socket itself is unusable, so retrying would only spin
+							return;
+					}
+				}
+				worker->serve(fd);
+			}
+		});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+	// The workers only stop if the socket can no longer be accepted from
+	handler(COULD_NOT_LISTEN_ON_SOCKET);
+	return COULD_NOT_LISTEN_ON_SOCKET;
+}
+
+
+int main(const int argc,  char* argv[]){
+	try {
+		return run(argc, argv);
+	} catch (const Error& e){
+	  #ifndef NO_EXCEPTIONS
+		fprintf(stderr, "%s\n", handler_msgs[e.rc]);
+	  #endif
+		return e.rc;
+	}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "errors.hpp"
+#include <compsky/macros/likely.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+
+/*
+ * The protocol between bpcsd and the programs, which send it their jobs when given -S (see bpcsd(1))
+ * Each connection carries one job. The program sends a Request, then the path of each vessel image (as a uint32_t length followed by that many characters), then - if embedding - the stream, which it ends by shutting down its side of the connection.
+ * The daemon replies with Frames, each followed by sz bytes, the last being FRAME_END.
+ * Integers are in the byte order of the machine, which both ends are on.
+ */
+
+
+namespace bpcsd {
+
+
+constexpr static
+const char magic[4] = {'B', 'P', 'C', 'S'};
+
+constexpr static
+const uint32_t protocol_version = 1;
+
+constexpr static
+const uint32_t max_n_imgs = 1 << 16;
+
+enum {
+	JOB_EXTRACT, // As bpcs-x
+	JOB_EMBED, // As bpcs -o
+	JOB_COUNT, // As bpcs-count, without -H or -I
+	N_JOBS
+};
+
+struct Request {
+	char magic[4];
+	uint32_t version;
+	uint32_t job;
+	uint32_t min_complexity;
+	uint32_t n_imgs;
+	int32_t level; // Of the png::WritePolicy, if embedding
+	int32_t filter;
+};
+
+enum {
+	FRAME_DATA, // Written to stdout
+	FRAME_IMG, // The PNG file of the arg-th vessel, with the data embedded in it
+	FRAME_END // arg is the exit status
+};
+
+struct Frame {
+	uint64_t sz;
+	uint32_t type;
+	uint32_t arg;
+};
+
+
+inline
+size_t recv_up_to_n_bytes(const int fd,  void* const buf,  const size_t n){
+	// Returns fewer than n only if the other end has shut down its side of the connection
+	size_t offset = 0;
+	while (offset != n){
+		const ssize_t n_read = recv(fd,  reinterpret_cast<char*>(buf) + offset,  n - offset,  0);
+		if (n_read == 0)
+			break;
+		if (unlikely(n_read == -1)){
+			if (errno == EINTR)
+				continue;
+			handler(DAEMON_PROTOCOL_ERROR);
+		}
+		offset += n_read;
+	}
+	return offset;
+}
+
+inline
+void recv_n_bytes(const int fd,  void* const buf,  const size_t n){
+	if (unlikely(recv_up_to_n_bytes(fd, buf, n) != n))
+		handler(DAEMON_PROTOCOL_ERROR);
+}
+
+inline
+void send_n_bytes(const int fd,  const void* const buf,  size_t n){
+	// With MSG_NOSIGNAL, so that the other end going away is an error rather than SIGPIPE
+	const char* itr = reinterpret_cast<const char*>(buf);
+	while (n != 0){
+		const ssize_t n_writ = send(fd, itr, n, MSG_NOSIGNAL);
+		if (unlikely(n_writ == -1)){
+			if (errno == EINTR)
+				continue;
+			handler(DAEMON_PROTOCOL_ERROR);
+		}
+		itr += n_writ;
+		n -= n_writ;
+	}
+}
+
+
+#ifdef DAEMON_CLIENT
+int run_job(const char* const socket_path,  const uint32_t job,  const unsigned min_complexity,  const int img_n_offset,  const int n_imgs,  char** const img_fps,  char* const out_fmt,  const int level,  const int filter);
+// Has the daemon listening on socket_path carry out the job, writing its output as the program would have. Returns the exit status.
+#endif
+
+
+} // namespace bpcsd
@@ -4,6 +4,12 @@
 #include <cstdlib> // for exit
 
 
+#if defined(LIBBPCS) || defined(DAEMON)
+// Errors are returned to the caller (or client), rather than ending the process
+# define HANDLER_THROWS
+#endif
+
+
 enum {
 	NAH_NO_ERROR,
 	MISC_ERROR,
@@ -55,6 +61,15 @@ enum {
 	
 	COULDNT_INIT_STD_HANDLES,
 	
+	KERNEL_MISMATCH,
+	
+	COULD_NOT_CONNECT_TO_DAEMON,
+	DAEMON_PROTOCOL_ERROR,
+	COULD_NOT_LISTEN_ON_SOCKET,
+	
+	VESSEL_CHANGED,
+	VESSEL_IS_INTERLACED,
+	
 	N_ERRORS
 };
 
@@ -115,14 +130,32 @@ const char* const handler_msgs[] = {
 	
 	"Could not initialise stdin and/or stdout file handles",
 	
+	"Optimised kernel disagrees with the reference implementation",
+	
+	"Could not connect to the daemon",
+	"Unexpected message to or from the daemon",
+	"Could not listen on the socket",
+	
+	"A vessel image changed while it was in use",
+	"Interlaced vessel images cannot be processed in bands",
+	
 	""
 };
 #endif
 
+#ifdef HANDLER_THROWS
+struct Error {
+	// Thrown by handler(), and caught by the library's functions (which return rc) or the daemon's workers (which send it to the client)
+	const int rc;
+};
+#endif
+
 inline
 void handler(const int rc){
-	// Do nothing on a bad test result in order for the test itself to be optimised out
-  #ifdef TESTS
+  #if defined(HANDLER_THROWS)
+	throw Error{rc};
+  #elif defined(TESTS)
+	// Do nothing on a bad test result otherwise, in order for the test itself to be optimised out
    #ifndef NO_EXCEPTIONS
 	fprintf(stderr, "%s\n", handler_msgs[rc]);
 	fflush(stderr);
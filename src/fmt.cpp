@@ -12,6 +12,9 @@
 #ifdef CHITTY_CHATTY
 # include <cstdio>
 #endif
+#ifdef STATS
+# include "stats.hpp"
+#endif
 
 
 typedef unsigned char uchar;
@@ -36,21 +39,31 @@ int main(const int argc,  char** argv){
 	setmode(fileno(stdout), O_BINARY);
   #endif
     
+  #ifdef STATS
+	const char* const program = *argv;
+  #endif
 	++argv;
-    if (argc != 1){
-		char* const arg = *argv;
-		if (arg[2] == 0  &&  arg[0] == '-'){
-			switch(arg[1]){
-				case 'o': out_fmt=*(++argv); break;
-				#ifdef EMBEDDOR
-				case 'm': embedding=true; break;
-				#endif
-			}
+	while ((*argv != nullptr)  and  ((*argv)[0] == '-')  and  ((*argv)[1] != 0)  and  ((*argv)[2] == 0)){
+		switch((*argv)[1]){
+			case 'o': out_fmt=*(++argv); break;
+			#ifdef EMBEDDOR
+			case 'm': embedding=true; break;
+			#endif
+			#ifdef STATS
+			case 'T':
+				stats::enable(program, *(++argv));
+				break;
+			#endif
+			default:
+				handler(WRONG_ARGUMENTS_TO_PROGRAM);
 		}
-    }
+		if (*argv == nullptr)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+		++argv;
+	}
 	
 #ifdef EMBEDDOR
-	char** msg_fps = argv + 1;
+	char** msg_fps = argv;
 #endif
     
     uint64_t n_msg_bytes;
@@ -1,6 +1,9 @@
 #include "fmt_os.hpp"
 #include "errors.hpp"
 #include <cerrno>
+#ifdef STATS
+# include "stats.hpp"
+#endif
 
 #ifdef _WIN32
 #else
@@ -127,6 +130,10 @@ fout_typ create_file_with_parent_dirs(char* const file_path,  const size_t file_
 
 
 void read_exact_number_of_bytes_from_stdin(char* const buf,  const size_t n){
+  #ifdef STATS
+	const stats::Timer timer(stats::READ_INPUT);
+	stats::add(stats::BYTES_IN, n);
+  #endif
 	size_t offset = 0;
 	do {
 	  #ifdef _WIN32
@@ -141,6 +148,10 @@ void read_exact_number_of_bytes_from_stdin(char* const buf,  const size_t n){
 
 
 void write_exact_number_of_bytes_to_stdout(char* const buf,  size_t n){
+  #ifdef STATS
+	const stats::Timer timer(stats::WRITE_OUTPUT);
+	stats::add(stats::BYTES_OUT, n);
+  #endif
 	do {
 	  #ifdef _WIN32
 		if (unlikely(fwrite(buf,  n,  1,  stdout) != 1))
@@ -174,6 +185,12 @@ void win__transfer_data_between_files(fout_typ in,  fout_typ out,  size_t n_byte
 
 
 void sendfile_from_file_to_stdout(const char* const fp,  const size_t n_bytes){
+	// Reads a file to be embedded
+  #ifdef STATS
+	const stats::Timer timer(stats::READ_INPUT);
+	stats::add(stats::BYTES_IN, n_bytes);
+	stats::add(stats::BYTES_OUT, n_bytes);
+  #endif
 	const fout_typ msg_file = open_file_for_reading(fp);
 	if (unlikely(msg_file == INVALID_HANDLE_VALUE2))
 		handler(CANNOT_OPEN_FILE);
@@ -189,6 +206,12 @@ void sendfile_from_file_to_stdout(const char* const fp,  const size_t n_bytes){
 
 
 void splice_from_stdin_to_fd(const fout_typ fout,  const size_t n_bytes){
+	// Writes an extracted file
+  #ifdef STATS
+	const stats::Timer timer(stats::WRITE_OUTPUT);
+	stats::add(stats::BYTES_IN, n_bytes);
+	stats::add(stats::BYTES_OUT, n_bytes);
+  #endif
   #ifdef _WIN32
 	win__transfer_data_between_files(stdin, fout, n_bytes);
   #else
@@ -232,7 +255,7 @@ size_t get_file_sz(const char* const fp){
 	CloseHandle(f);
 	return f_sz.QuadPart;
   #else
-	static struct stat stat_buf;
+	struct stat stat_buf;
 	const auto rc3 = stat(fp, &stat_buf);
 	if (unlikely(rc3 == -1))
 		handler(COULD_NOT_STAT_FILE, fp);
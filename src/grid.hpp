@@ -0,0 +1,102 @@
+#pragma once
+
+#include "typedefs.hpp"
+#include <type_traits> // for std::conditional
+
+
+/*
+ * The grids that data is embedded in, each of one bit per byte
+ * Shared by the stream and the benchmarks
+ */
+
+
+template<unsigned W,  unsigned H>
+struct Grid {
+	// The shape of the grids, which every kernel is specialised for, so that their loops have constant bounds
+	constexpr static unsigned w = W;
+	constexpr static unsigned h = H;
+	constexpr static unsigned sz = W * H;
+	constexpr static unsigned conjugation_bit_indx = sz - 1;
+	constexpr static unsigned n_bytes = (sz - 1) / 8; // Embedded in each grid
+	constexpr static unsigned max_complexity = H * (W - 1)  +  W * (H - 1);
+	typedef typename std::conditional<(max_complexity <= 255), uint8_t, uint16_t>::type complexity_typ;
+};
+
+typedef Grid<GRID_SIZE, GRID_SIZE> DefaultGrid; // Used unless another size is chosen with -g, and by the library and the daemon
+
+#ifdef GRID_SIZE_OPTION
+// The side lengths of the square grids that bpcs, bpcs-x and bpcs-count can be told to use with -g. Only odd lengths give grids of whole bytes.
+// Everything that depends on the size is compiled for each of them, so using any of them is as fast as a build for that size alone.
+# define FOR_EACH_GRID_SIZE(X)  X(5)  X(7)  X(9)  X(11)  X(13)  X(15)
+#else
+# define FOR_EACH_GRID_SIZE(X)  X(GRID_SIZE)
+#endif
+
+#define IS_GRID_SIZE(N)  (N == GRID_SIZE) or
+static_assert(FOR_EACH_GRID_SIZE(IS_GRID_SIZE) false,  "GRID_SIZE must be one of the sizes that -g can choose");
+#undef IS_GRID_SIZE
+static_assert((GRID_SIZE % 2 == 1)  and  (GRID_SIZE >= 3),  "Only grids of odd length hold a whole number of bytes");
+
+
+/*
+ * Bitwise operations on matrices
+ */
+inline
+constexpr
+uint8_t to_cgc(const uint8_t n){
+	return n ^ (n / 2);
+}
+
+
+template<class G>
+constexpr
+unsigned get_grid_complexity(const uchar grid[G::sz]){
+	unsigned sum = 0;
+	
+	// Complexity of horizontal neighbours
+	size_t _indx = 0;
+	for (unsigned j = 0;  j < G::h;  ++j){
+		for (unsigned i = 0;  i < G::w - 1;  ++i){
+			sum += grid[_indx] ^ grid[_indx + 1];
+			_indx += 1;
+		}
+		_indx += 1; // Skip the last column
+	}
+	
+	// Complexity of vertical neighbours
+	for (unsigned i = 0;  i < G::w;  ++i){
+		size_t _indx = i;
+		for (unsigned j = 0;  j < G::h - 1;  ++j){
+			sum += grid[_indx] ^ grid[_indx + G::w];
+			_indx += G::w;
+		}
+	}
+    
+    return sum;
+}
+
+
+constexpr
+static
+const uint8_t from_cgc[256] = {0, 1, 3, 2, 7, 6, 4, 5, 15, 14, 12, 13, 8, 9, 11, 10, 31, 30, 28, 29, 24, 25, 27, 26, 16, 17, 19, 18, 23, 22, 20, 21, 63, 62, 60, 61, 56, 57, 59, 58, 48, 49, 51, 50, 55, 54, 52, 53, 32, 33, 35, 34, 39, 38, 36, 37, 47, 46, 44, 45, 40, 41, 43, 42, 127, 126, 124, 125, 120, 121, 123, 122, 112, 113, 115, 114, 119, 118, 116, 117, 96, 97, 99, 98, 103, 102, 100, 101, 111, 110, 108, 109, 104, 105, 107, 106, 64, 65, 67, 66, 71, 70, 68, 69, 79, 78, 76, 77, 72, 73, 75, 74, 95, 94, 92, 93, 88, 89, 91, 90, 80, 81, 83, 82, 87, 86, 84, 85, 255, 254, 252, 253, 248, 249, 251, 250, 240, 241, 243, 242, 247, 246, 244, 245, 224, 225, 227, 226, 231, 230, 228, 229, 239, 238, 236, 237, 232, 233, 235, 234, 192, 193, 195, 194, 199, 198, 196, 197, 207, 206, 204, 205, 200, 201, 203, 202, 223, 222, 220, 221, 216, 217, 219, 218, 208, 209, 211, 210, 215, 214, 212, 213, 128, 129, 131, 130, 135, 134, 132, 133, 143, 142, 140, 141, 136, 137, 139, 138, 159, 158, 156, 157, 152, 153, 155, 154, 144, 145, 147, 146, 151, 150, 148, 149, 191, 190, 188, 189, 184, 185, 187, 186, 176, 177, 179, 178, 183, 182, 180, 181, 160, 161, 163, 162, 167, 166, 164, 165, 175, 174, 172, 173, 168, 169, 171, 170};
+
+
+template<class G>
+inline
+void conjugate(uchar grid[G::sz]){
+	for (unsigned j = 0;  j < G::h;  ++j)
+		for (unsigned i = 0;  i < G::w;  ++i)
+			grid[G::w*j + i] ^= 1 ^ ((i & 1) ^ (j & 1));
+			// NOTE: chequerboard.val[0] should be 1, so that when the chequerboard is applied to grids, the grid[G::conjugation_bit_indx] == 1 (to mark it as conjugated)
+}
+
+template<class G>
+inline
+void grid_to_bytes(const uchar grid[G::sz],  uchar* msg_arr){
+    for (uint_fast8_t j=0; j<G::n_bytes; ++j){
+		msg_arr[j] = 0;
+        for (uint_fast8_t i=0; i<8; ++i){
+			msg_arr[j] |= grid[8*j +i] << i;
+        }
+    }
+}
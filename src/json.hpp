@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdio>
+
+
+namespace json {
+
+
+inline
+void print_str(FILE* const f,  const char* str){
+	// Writes str as a JSON string, with its quotes, backslashes and control characters escaped
+	fputc('"', f);
+	for (;  *str != 0;  ++str){
+		if ((*str == '"')  or  (*str == '\\'))
+			fputc('\\', f);
+		if ((unsigned char)(*str) < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+
+} // namespace json
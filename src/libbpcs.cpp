@@ -0,0 +1,145 @@
+#include "libbpcs.h"
+#include "bpcs.hpp"
+#include "errors.hpp"
+#include "alloc.hpp"
+#include <compsky/macros/likely.hpp>
+#include <climits> // for INT_MAX
+#include <cstring> // for memcpy
+#include <new> // for std::bad_alloc
+
+
+static_assert((int(BPCS_ERR_TOO_MUCH_DATA) == TOO_MUCH_DATA_TO_ENCODE)  and  (int(BPCS_ERR_INVALID_PNG) == INVALID_PNG_MAGIC_NUMBER)  and  (int(BPCS_ERR_OOM) == OOM)  and  (int(BPCS_ERR_INVALID_ARGUMENTS) == WRONG_ARGUMENTS_TO_PROGRAM),  "The return codes are the exit statuses of the programs");
+static_assert((int(BPCS_FILTER_NONE) == png::FILTER_NONE)  and  (int(BPCS_FILTER_PAETH) == png::FILTER_PAETH)  and  (int(BPCS_FILTER_ALL) == png::FILTER_ALL),  "The filters are png's filters");
+
+
+template<typename Fn>
+int catch_errors(Fn fn){
+	// handler() throws rather than exiting, so that its error code can be returned
+	try {
+		fn();
+	} catch (const Error& e){
+		return e.rc;
+	} catch (const std::bad_alloc&){
+		return OOM;
+	}
+	return NAH_NO_ERROR;
+}
+
+
+static
+void init_stream(BPCSStreamBuf<DefaultGrid>& bpcs_stream,  const bpcs_vessel* const vessels,  const size_t n_vessels,  const bpcs_allocator* const allocator){
+	if (unlikely((vessels == nullptr)  or  (n_vessels == 0)  or  (n_vessels > INT_MAX)))
+		handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	bpcs_stream.img_bufs = vessels;
+	bpcs_stream.allocator = (allocator == nullptr) ? &alloc::default_allocator : allocator;
+}
+
+
+extern "C"
+int bpcs_count(const bpcs_vessel* const vessels,  const size_t n_vessels,  const unsigned min_complexity,  uint64_t* const n_bytes,  const bpcs_allocator* const allocator){
+	return catch_errors([&](){
+		BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, n_vessels, nullptr, false, nullptr);
+		init_stream(bpcs_stream, vessels, n_vessels, allocator);
+		uint64_t n = 0;
+		for (int img_n = 0;  img_n != bpcs_stream.n_imgs;  ++img_n){
+			bpcs_stream.decode_img(img_n);
+			n += bpcs_stream.get_img_sz();
+		}
+		*n_bytes = n;
+	});
+}
+
+
+extern "C"
+int bpcs_extract(const bpcs_vessel* const vessels,  const size_t n_vessels,  const unsigned min_complexity,  bpcs_buf* const out,  const bpcs_allocator* const allocator){
+	out->data = nullptr;
+	out->sz = 0;
+	const bpcs_allocator* const _allocator = (allocator == nullptr) ? &alloc::default_allocator : allocator;
+	const int rc = catch_errors([&](){
+		// Extracts each bitplane at once, as extract_to_stdout_threaded does, as the size of each is known before it is extracted
+		BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, n_vessels, nullptr, false, nullptr);
+		init_stream(bpcs_stream, vessels, n_vessels, _allocator);
+		size_t out_capacity = 0;
+		for (int img_n = 0;  img_n != bpcs_stream.n_imgs;  ++img_n){
+			bpcs_stream.decode_img(img_n);
+			const size_t sz = out->sz + bpcs_stream.get_img_sz();
+			if (sz > out_capacity){
+				// Leave room for the images after it, so as not to reallocate for each one
+				out_capacity = (2 * out_capacity > sz) ? 2 * out_capacity : sz;
+				uchar* const data = (uchar*)alloc::realloc(_allocator, out->data, out_capacity);
+				if (unlikely(data == nullptr))
+					handler(OOM);
+				out->data = data;
+			}
+			for (int i = 0;  i < N_CHANNELS * bpcs_stream.n_bitplanes;  ++i){
+				bpcs_stream.get_bitplane(i,  out->data + out->sz);
+				out->sz += bpcs_stream.get_bitplane_sz(i);
+			}
+		}
+	});
+	if (rc != NAH_NO_ERROR){
+		alloc::free(_allocator, out->data);
+		out->data = nullptr;
+		out->sz = 0;
+	}
+	return rc;
+}
+
+
+extern "C"
+int bpcs_embed(const bpcs_vessel* const vessels,  const size_t n_vessels,  const unsigned min_complexity,  const uint8_t* const data,  const size_t data_sz,  const bpcs_write_policy* const policy,  bpcs_buf* const out_imgs,  const bpcs_allocator* const allocator){
+	const bpcs_allocator* const _allocator = (allocator == nullptr) ? &alloc::default_allocator : allocator;
+	for (size_t i = 0;  i < n_vessels;  ++i){
+		out_imgs[i].data = nullptr;
+		out_imgs[i].sz = 0;
+	}
+	const int rc = catch_errors([&](){
+		// Embeds the grids as embed_from_stdin does
+		BPCSStreamBuf<DefaultGrid> bpcs_stream(min_complexity, 0, n_vessels, nullptr, true, nullptr);
+		init_stream(bpcs_stream, vessels, n_vessels, _allocator);
+		bpcs_stream.out_bufs = out_imgs;
+		if (policy != nullptr){
+			if (unlikely((policy->level < 0)  or  (policy->level > 9)  or  (policy->filter < 0)  or  (policy->filter > png::FILTER_ALL)))
+				handler(WRONG_ARGUMENTS_TO_PROGRAM);
+			bpcs_stream.write_policy.level = policy->level;
+			bpcs_stream.write_policy.filter = policy->filter;
+		}
+		// Compressed on the calling thread, which is where handler() must throw from
+		bpcs_stream.write_policy.n_threads = 1;
+
+		bpcs_stream.load_next_img();
+		uchar grid_bytes[DefaultGrid::n_bytes]; // put() modifies the bytes it is given
+		const uint8_t* itr = data;
+		const uint8_t* const end = data  +  (data_sz / DefaultGrid::n_bytes) * DefaultGrid::n_bytes;
+		for (;  itr != end;  itr += DefaultGrid::n_bytes){
+			memcpy(grid_bytes, itr, DefaultGrid::n_bytes);
+			bpcs_stream.put(grid_bytes);
+		}
+		// The final grid is padded with zeros, so is entirely zeros if the data ends on a grid boundary
+		const size_t n_bytes_left = data_sz % DefaultGrid::n_bytes;
+		memcpy(grid_bytes, itr, n_bytes_left);
+		memset(grid_bytes + n_bytes_left,  0,  DefaultGrid::n_bytes - n_bytes_left);
+		bpcs_stream.put(grid_bytes);
+		bpcs_stream.save_im();
+	});
+	if (rc != NAH_NO_ERROR){
+		for (size_t i = 0;  i < n_vessels;  ++i){
+			alloc::free(_allocator, out_imgs[i].data);
+			out_imgs[i].data = nullptr;
+			out_imgs[i].sz = 0;
+		}
+	}
+	return rc;
+}
+
+
+extern "C"
+const char* bpcs_strerror(const int rc){
+	if ((rc < 0)  or  (rc >= N_ERRORS))
+		return "Unknown error";
+  #ifdef NO_EXCEPTIONS
+	return (rc == NAH_NO_ERROR) ? "No error" : "Error";
+  #else
+	return handler_msgs[rc];
+  #endif
+}
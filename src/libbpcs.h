@@ -0,0 +1,84 @@
+#ifndef BPCS_H
+#define BPCS_H
+
+/*
+ * libbpcs - embeds data in, and extracts it from, PNG images that are held in memory
+ * Installed as <bpcs/bpcs.h>. See bpcs(3).
+ * The library has no global state, so its functions may be called from any number of threads at once.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+enum {
+	// Return codes. Any other non-zero code is one of the exit statuses of bpcs(1), which bpcs_strerror describes.
+	BPCS_OK = 0,
+	BPCS_ERR_TOO_MUCH_DATA = 2, // The data does not fit in the vessel images
+	BPCS_ERR_INVALID_PNG = 3,
+	BPCS_ERR_OOM = 4,
+	BPCS_ERR_INVALID_ARGUMENTS = 16
+};
+
+enum {
+	// The PNG row filters that output images may be written with
+	BPCS_FILTER_NONE,
+	BPCS_FILTER_SUB,
+	BPCS_FILTER_UP,
+	BPCS_FILTER_AVG,
+	BPCS_FILTER_PAETH,
+	BPCS_FILTER_ALL // Choose the best filter for each row
+};
+
+typedef struct bpcs_allocator {
+	void* (*realloc_fn)(void* ctx,  void* ptr,  size_t sz); // As realloc(3), including allocating if ptr is NULL. Returns NULL if out of memory.
+	void (*free_fn)(void* ctx,  void* ptr); // Never passed NULL
+	void* ctx;
+} bpcs_allocator;
+
+typedef struct bpcs_vessel {
+	// The contents of a PNG file
+	const uint8_t* data;
+	size_t sz;
+} bpcs_vessel;
+
+typedef struct bpcs_buf {
+	// Allocated with the allocator that was given to the function that returned it, which it must be freed with
+	uint8_t* data;
+	size_t sz;
+} bpcs_buf;
+
+typedef struct bpcs_write_policy {
+	int level; // zlib compression level, from 0 to 9
+	int filter; // One of BPCS_FILTER_*
+} bpcs_write_policy;
+
+
+/*
+ * Every function takes an allocator, which every buffer the library allocates is allocated with. If it is NULL, malloc(3) is used.
+ * The grids of each vessel with a complexity of at least min_complexity hold the data, as with bpcs(1).
+ */
+
+int bpcs_count(const bpcs_vessel* vessels,  size_t n_vessels,  unsigned min_complexity,  uint64_t* n_bytes,  const bpcs_allocator* allocator);
+// Sets n_bytes to the number of bytes that can be embedded in the vessels, as bpcs-count(1) prints
+
+int bpcs_extract(const bpcs_vessel* vessels,  size_t n_vessels,  unsigned min_complexity,  bpcs_buf* out,  const bpcs_allocator* allocator);
+// Sets out to every byte embedded in the vessels, as bpcs-x(1) writes. This is still in the format written by bpcs-fmt(1).
+
+int bpcs_embed(const bpcs_vessel* vessels,  size_t n_vessels,  unsigned min_complexity,  const uint8_t* data,  size_t data_sz,  const bpcs_write_policy* policy,  bpcs_buf* out_imgs,  const bpcs_allocator* allocator);
+// Embeds data (as written by bpcs-fmt(1)) in the vessels, setting out_imgs - an array of n_vessels elements - to the resulting PNG images.
+// The vessels after the last one that the data reached are not rewritten, so their elements are left empty ({NULL, 0}).
+// policy is NULL for the defaults of bpcs(1).
+
+const char* bpcs_strerror(int rc);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,58 +1,384 @@
 #include "bpcs.hpp"
 #include "os.hpp"
 #include "errors.hpp"
+#include "cpu.hpp"
 #include <compsky/macros/likely.hpp>
 #define LIBCOMPSKY_NO_TESTS
 #include <compsky/deasciify/a2n.hpp>
+#include <cstring> // for strcmp
 #ifdef _WIN32
 # include <fcntl.h> // for O_BINARY
 #endif
+#ifdef DAEMON_CLIENT
+# include "daemon.hpp"
+#endif
 
 
-int main(const int argc, char* argv[]){
-	static uchar io_buf[IO_BUF_SZ];
+struct Options {
+	unsigned min_complexity;
+#ifdef EMBEDDOR
+	bool embedding = false;
+	char* out_fmt = NULL;
+	png::WritePolicy write_policy;
+#endif
+#ifdef ENABLE_THREADS
+	unsigned n_threads = 0; // 0 for the original single-threaded extraction
+#endif
+#ifdef ONLY_COUNT
+	bool print_histogram = false;
+#endif
+#ifdef COMPLEXITY_INDEX
+	bool write_index = false;
+#endif
+#ifdef BAND_STREAMING
+	bool is_banded = false; // Whether vessel images are processed a band of rows at a time, rather than whole
+#endif
+#ifdef RANDOM_ACCESS
+	bool is_random_access = false;
+	uint64_t offset = 0; // Of the first byte of the stream to extract
+	uint64_t length = UINT64_MAX; // Maximum number of bytes to extract
+#endif
+};
+
+
+#ifdef ONLY_COUNT
+template<class G>
+void print_counts(const Options& opts,  const uint64_t* const histogram,  const int max_n_bitplanes){
+	// histogram holds (G::max_complexity + 1) counts for each bitplane, indexed as (channel_n * MAX_BITPLANES + bitplane_n)
+	constexpr size_t n_complexities = G::max_complexity + 1;
+	if (opts.print_histogram){
+		for (auto k = 0;  k < N_CHANNELS;  ++k){
+			for (auto n = 0;  n < max_n_bitplanes;  ++n){
+				const uint64_t* const counts = histogram  +  (k * MAX_BITPLANES + n) * n_complexities;
+				printf("%d %d", k, n);
+				for (size_t c = 0;  c < n_complexities;  ++c)
+					printf(" %lu", counts[c]);
+				printf("\n");
+			}
+		}
+	} else {
+		uint64_t count = 0;
+		for (auto k = 0;  k < N_CHANNELS;  ++k)
+			for (auto n = 0;  n < max_n_bitplanes;  ++n)
+				for (size_t c = opts.min_complexity;  c < n_complexities;  ++c)
+					count += histogram[(k * MAX_BITPLANES + n) * n_complexities  +  c];
+		printf("%lu\n", count * G::n_bytes);
+	}
+}
+#endif
+
+
+#ifdef BAND_STREAMING
+template<class G>
+int run_bands(const Options& opts,  int i,  const int argc,  char* argv[]){
+	// Carries out the job a band of rows of each vessel image at a time, as run does with whole images
+  #ifdef ENABLE_THREADS
+	if (opts.n_threads != 0)
+		handler(WRONG_ARGUMENTS_TO_PROGRAM);
+  #endif
+  #ifdef RANDOM_ACCESS
+	if (opts.is_random_access)
+		handler(WRONG_ARGUMENTS_TO_PROGRAM);
+  #endif
+  #ifdef COMPLEXITY_INDEX
+	if (opts.write_index)
+		handler(WRONG_ARGUMENTS_TO_PROGRAM);
+  #endif
+	
+	BandStreamBuf<G> band_stream(opts.min_complexity, ++i, argc, argv
+	                           #ifdef EMBEDDOR
+	                           , opts.embedding
+	                           , opts.out_fmt
+	                           #endif
+	                           );
+  #ifdef EMBEDDOR
+	band_stream.write_policy = opts.write_policy;
+  #endif
 	
+#ifdef ONLY_COUNT
+	constexpr size_t n_complexities = G::max_complexity + 1;
+	static uint64_t histogram[N_CHANNELS * MAX_BITPLANES * n_complexities];
+	int max_n_bitplanes = 0;
+	for (int n = i;  n < argc;  ++n){
+		band_stream.add_to_histogram(n, histogram);
+		if (band_stream.n_bitplanes > max_n_bitplanes)
+			max_n_bitplanes = band_stream.n_bitplanes;
+	}
+	print_counts<G>(opts, histogram, max_n_bitplanes);
+#else
+	static uchar io_buf[io_buf_sz<G>];
+	band_stream.load_next_img(); // Init
+# ifdef EMBEDDOR
+	if (opts.embedding)
+		os::embed_from_stdin(band_stream, io_buf);
+	else
+# endif
+	os::extract_to_stdout(band_stream, io_buf);
+#endif
+	return 0;
+}
+#endif
+
+
+template<class G>
+int run(const Options& opts,  int i,  const int argc,  char* argv[]){
+	// Carries out the job with grids of G. i is the index of the argument before the first vessel image.
+  #ifdef BAND_STREAMING
+	if (opts.is_banded)
+		return run_bands<G>(opts, i, argc, argv);
+  #endif
+  #ifndef ONLY_COUNT
+	// bpcs-count does not extract or embed
+	static uchar io_buf[io_buf_sz<G>];
+  #endif
+
+    BPCSStreamBuf<G> bpcs_stream(opts.min_complexity, ++i, argc, argv
+                              #ifdef EMBEDDOR
+                              , opts.embedding
+                              , opts.out_fmt
+                              #endif
+                              );
+  #ifdef EMBEDDOR
+	bpcs_stream.write_policy = opts.write_policy;
+  #endif
+
+#ifdef RANDOM_ACCESS
+	if (opts.is_random_access){
+	  #ifdef EMBEDDOR
+		if (opts.embedding)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #ifdef ENABLE_THREADS
+		if (opts.n_threads != 0)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+		bpcs_stream.seek(opts.offset / G::n_bytes);
+		os::extract_range_to_stdout(bpcs_stream,  io_buf,  opts.offset % G::n_bytes,  opts.length);
+		return 0;
+	}
+#endif
+
+#ifdef ENABLE_THREADS
+	if (opts.n_threads != 0){
+	  #ifdef EMBEDDOR
+		if (opts.embedding)
+			os::embed_from_stdin_threaded<G>(opts.min_complexity, i, argc, argv, opts.out_fmt, opts.write_policy, opts.n_threads);
+		else
+	  #endif
+		os::extract_to_stdout_threaded(bpcs_stream, opts.n_threads);
+		return 0;
+	}
+#endif
+
+#ifdef ONLY_COUNT
+	// Only the complexities of the grids are calculated, rather than extracting them
+	constexpr size_t n_complexities = G::max_complexity + 1;
+	static uint64_t histogram[N_CHANNELS * MAX_BITPLANES * n_complexities];
+	int max_n_bitplanes = 0;
+	for (int n = i;  n < argc;  ++n){
+		bpcs_stream.decode_img(n);
+	  #ifdef COMPLEXITY_INDEX
+		if (opts.write_index)
+			bpcs_stream.write_complexity_index();
+	  #endif
+		bpcs_stream.add_to_histogram(histogram);
+		if (bpcs_stream.n_bitplanes > max_n_bitplanes)
+			max_n_bitplanes = bpcs_stream.n_bitplanes;
+	}
+	print_counts<G>(opts, histogram, max_n_bitplanes);
+#else
+    bpcs_stream.load_next_img(); // Init
+
+# ifdef EMBEDDOR
+  if (!opts.embedding){
+# endif
+	os::extract_to_stdout(bpcs_stream, io_buf);
+# ifdef EMBEDDOR
+  } else {
+	os::embed_from_stdin(bpcs_stream, io_buf);
+  }
+# endif
+#endif
+	return 0;
+}
+
+
+int main(const int argc, char* argv[]){
     int i = 0;
 	if (unlikely(argc == 1))
 		handler(WRONG_ARGUMENTS_TO_PROGRAM);
 	
+	if (strcmp(argv[1], "--cpu-features") == 0){
+		// Not an option of a job, so not one letter like the others
+		cpu::print_features(stdout);
+		return 0;
+	}
+	
   #ifdef _WIN32
 	setmode(fileno(stdout), O_BINARY);
   #endif
 	
-#ifdef EMBEDDOR
-    const bool embedding = (argv[1][0] == '-' && argv[1][1] == 'o' && argv[1][2] == 0);
-    
-    char* out_fmt;
-    
-    if (embedding){
-        ++i;
-        out_fmt = argv[++i];
-    } else
-        out_fmt = NULL;
+	Options opts;
+	unsigned grid_size = GRID_SIZE;
+#ifdef DAEMON_CLIENT
+	const char* socket_path = nullptr; // Of the daemon to send the job to, rather than carrying it out
+#endif
+#ifdef STATS
+	const char* stats_fp = nullptr; // To write the stats of the run to, or "-" for stderr
+#endif
+#ifdef TRACING
+	const char* trace_fp = nullptr; // To write the trace of the run to, or "-" for stderr
 #endif
     
-	const unsigned min_complexity = a2n<unsigned>(argv[++i]);
+	while ((i + 1 < argc)  and  (argv[i+1][0] == '-')){
+		const char* const arg = argv[++i];
+		if (unlikely(arg[2] != 0))
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+		switch(arg[1]){
+		  #ifdef EMBEDDOR
+			case 'o':
+				opts.embedding = true;
+				opts.out_fmt = argv[++i];
+				break;
+			case 'z': {
+				// a2n would read a negative or non-numeric level as 0
+				const char* const level = argv[++i];
+				if (unlikely((level[0] < '0')  or  (level[0] > '9')  or  (level[1] != 0)))
+					handler(WRONG_ARGUMENTS_TO_PROGRAM);
+				opts.write_policy.level = level[0] - '0';
+				break;
+			}
+			case 'f':
+				opts.write_policy.filter = png::get_filter_from_name(argv[++i]);
+				if (unlikely(opts.write_policy.filter == -1))
+					handler(WRONG_ARGUMENTS_TO_PROGRAM);
+				break;
+		  #endif
+		  #ifdef ENABLE_THREADS
+			case 'j':
+				opts.n_threads = a2n<unsigned>(argv[++i]);
+				break;
+		  #endif
+		  #ifdef BAND_STREAMING
+			case 'b':
+				opts.is_banded = true;
+				break;
+		  #endif
+		  #ifdef RANDOM_ACCESS
+			case 's':
+				opts.is_random_access = true;
+				opts.offset = a2n<uint64_t>(argv[++i]);
+				break;
+			case 'n':
+				opts.is_random_access = true;
+				opts.length = a2n<uint64_t>(argv[++i]);
+				break;
+		  #endif
+		  #ifdef ONLY_COUNT
+			case 'H':
+				opts.print_histogram = true;
+				break;
+		  #endif
+		  #if defined(ONLY_COUNT) && defined(COMPLEXITY_INDEX)
+			case 'I':
+				opts.write_index = true;
+				break;
+		  #endif
+		  #ifdef GRID_SIZE_OPTION
+			case 'g':
+				grid_size = a2n<unsigned>(argv[++i]);
+				break;
+		  #endif
+		  #ifdef DAEMON_CLIENT
+			case 'S':
+				socket_path = argv[++i];
+				break;
+		  #endif
+		  #ifdef STATS
+			case 'T':
+				stats_fp = argv[++i];
+				break;
+		  #endif
+		  #ifdef TRACING
+			case 't':
+				trace_fp = argv[++i];
+				break;
+		  #endif
+			default:
+				handler(WRONG_ARGUMENTS_TO_PROGRAM);
+		}
+	}
     
-    BPCSStreamBuf bpcs_stream(min_complexity, ++i, argc, argv
-                              #ifdef EMBEDDOR
-                              , embedding
-                              , out_fmt
-                              #endif
-                              );
-    bpcs_stream.load_next_img(); // Init
+#ifdef ONLY_COUNT
+	// The histogram covers every threshold
+	opts.min_complexity = (opts.print_histogram) ? 0 : a2n<unsigned>(argv[++i]);
+#else
+	opts.min_complexity = a2n<unsigned>(argv[++i]);
+#endif
     
-#ifdef EMBEDDOR
-  if (!embedding){
+#ifdef DAEMON_CLIENT
+	if (socket_path != nullptr){
+		// The daemon has its own threads, only carries out whole jobs, and only uses the default grid size
+		if (grid_size != GRID_SIZE)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #ifdef ENABLE_THREADS
+		if (opts.n_threads != 0)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #ifdef BAND_STREAMING
+		if (opts.is_banded)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #ifdef RANDOM_ACCESS
+		if (opts.is_random_access)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #ifdef ONLY_COUNT
+		if (opts.print_histogram)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #ifdef COMPLEXITY_INDEX
+		if (opts.write_index)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #ifdef STATS
+		if (stats_fp != nullptr)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #ifdef TRACING
+		if (trace_fp != nullptr)
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+	  #endif
+	  #if defined(ONLY_COUNT)
+		return bpcsd::run_job(socket_path, bpcsd::JOB_COUNT, opts.min_complexity, i + 1, argc, argv, nullptr, 0, 0);
+	  #elif defined(EMBEDDOR)
+		return bpcsd::run_job(socket_path, (opts.embedding) ? bpcsd::JOB_EMBED : bpcsd::JOB_EXTRACT, opts.min_complexity, i + 1, argc, argv, opts.out_fmt, opts.write_policy.level, opts.write_policy.filter);
+	  #else
+		return bpcsd::run_job(socket_path, bpcsd::JOB_EXTRACT, opts.min_complexity, i + 1, argc, argv, nullptr, 0, 0);
+	  #endif
+	}
 #endif
-	const size_t count = os::extract_to_stdout(bpcs_stream, io_buf);
-#ifdef EMBEDDOR
-  } else {
-	os::embed_from_stdin(bpcs_stream, io_buf);
-  }
+    
+#ifdef STATS
+	if (stats_fp != nullptr)
+		stats::enable(argv[0], stats_fp);
+	// Whatever is not attributed to another stage is the work of the stream itself
+	const stats::Timer timer(stats::GRIDS);
 #endif
-#ifdef ONLY_COUNT
-	printf("%lu\n", count);
+#ifdef TRACING
+	if (trace_fp != nullptr)
+		trace::enable(trace_fp);
 #endif
-	return 0;
+    
+	// Each grid size has its own build of the stream, so the choice is only made once
+	switch(grid_size){
+	  #define CASE(N) \
+		case N: \
+			return run<Grid<N, N>>(opts, i, argc, argv);
+		FOR_EACH_GRID_SIZE(CASE)
+	  #undef CASE
+		default:
+			handler(WRONG_ARGUMENTS_TO_PROGRAM);
+			return WRONG_ARGUMENTS_TO_PROGRAM;
+	}
 }
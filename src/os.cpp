@@ -1,10 +1,32 @@
 #include "os.hpp"
 #ifndef _WIN32
 # include <unistd.h>
+# include <cerrno>
+#endif
+#ifdef ENABLE_THREADS
+# include <thread>
+# include <mutex>
+# include <condition_variable>
+# include <vector>
+# include <deque>
+# include <atomic>
+#endif
+#include <cstring> // for memset
+#ifdef VMSPLICE_OUTPUT
+# include <fcntl.h> // for vmsplice, F_SETPIPE_SZ
+# include <sys/stat.h>
+# include <sys/uio.h> // for iovec
 #endif
 
 
-bool write_to_stdout(const uchar io_buf[IO_BUF_SZ],  const size_t n_bytes){
+bool write_to_stdout(const uchar* const io_buf,  const size_t n_bytes){
+  #ifdef STATS
+	const stats::Timer timer(stats::WRITE_OUTPUT);
+	stats::add(stats::BYTES_OUT, n_bytes);
+  #endif
+  #ifdef TRACING
+	const trace::Span span("write_to_stdout", trace::Args{nullptr, -1, int64_t(n_bytes)});
+  #endif
   #ifdef _WIN32
 	return (unlikely(fwrite(io_buf, n_bytes, 1, stdout) != 1));
   #else
@@ -13,55 +35,451 @@ bool write_to_stdout(const uchar io_buf[IO_BUF_SZ],  const size_t n_bytes){
 }
 
 
-bool read_from_stdin(uchar io_buf[IO_BUF_SZ]){
-  #ifdef _WIN32
-	return (unlikely(fread(io_buf, BYTES_PER_GRID, 1, stdin) != 1));
-  #else
-	return (read(STDIN_FILENO, io_buf, BYTES_PER_GRID) != BYTES_PER_GRID);
+#ifdef VMSPLICE_OUTPUT
+uchar* alloc_vmsplice_bufs(size_t& buf_sz,  const size_t min_buf_sz){
+	// Returns two contiguous page-aligned buffers, each as large as the stdout pipe, or nullptr if stdout is not a pipe (or is smaller than min_buf_sz)
+	// The pipe is resized to DESIRED_IO_BUF_SZ if possible.
+	// Once an entire buffer has been spliced into the pipe, the pipe can no longer hold any of the other buffer, so the other buffer can be reused.
+	struct stat st;
+	if ((fstat(STDOUT_FILENO, &st) != 0)  or  (not S_ISFIFO(st.st_mode)))
+		return nullptr;
+	int pipe_sz = fcntl(STDOUT_FILENO, F_SETPIPE_SZ, DESIRED_IO_BUF_SZ);
+	if (pipe_sz == -1)
+		pipe_sz = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+	if ((pipe_sz == -1)  or  (size_t(pipe_sz) < min_buf_sz))
+		return nullptr;
+	buf_sz = pipe_sz;
+	void* bufs;
+	if (unlikely(posix_memalign(&bufs,  sysconf(_SC_PAGESIZE),  2 * buf_sz) != 0))
+		handler(OOM);
+	return (uchar*)bufs;
+}
+
+void vmsplice_to_stdout(const uchar* const buf,  const size_t n_bytes){
+	// The pipe refers to the pages of buf rather than copying them, so buf must not be modified until they have been read from the pipe
+  #ifdef STATS
+	const stats::Timer timer(stats::WRITE_OUTPUT);
+	stats::add(stats::BYTES_OUT, n_bytes);
+  #endif
+  #ifdef TRACING
+	const trace::Span span("vmsplice_to_stdout", trace::Args{nullptr, -1, int64_t(n_bytes)});
+  #endif
+	struct iovec iov;
+	iov.iov_base = const_cast<uchar*>(buf);
+	iov.iov_len = n_bytes;
+	while (iov.iov_len != 0){
+		const ssize_t n_writ = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+		if (unlikely(n_writ == -1)){
+			if (errno == EINTR)
+				continue;
+			handler(CANNOT_WRITE_TO_STDOUT);
+		}
+		iov.iov_base = (uchar*)iov.iov_base + n_writ;
+		iov.iov_len -= n_writ;
+	}
+}
+#endif
+
+
+#ifdef EMBEDDOR
+size_t read_up_to_n_bytes_from_stdin(uchar* buf,  const size_t n){
+	// Returns fewer than n only at the end of the stream. A short read from a pipe is not the end of the stream.
+  #ifdef STATS
+	const stats::Timer timer(stats::READ_INPUT);
+  #endif
+  #ifdef TRACING
+	const trace::Span span("read_from_stdin", trace::Args{nullptr, -1, int64_t(n)});
   #endif
+	size_t offset = 0;
+	while (offset != n){
+	  #ifdef _WIN32
+		const size_t n_read = fread(buf + offset,  1,  n - offset,  stdin);
+		if (n_read == 0)
+			break;
+	  #else
+		const ssize_t n_read = read(STDIN_FILENO,  buf + offset,  n - offset);
+		if (n_read == 0)
+			break;
+		if (unlikely(n_read == -1)){
+			if (errno == EINTR)
+				continue;
+			handler(CANNOT_READ_FROM_STDIN);
+		}
+	  #endif
+		offset += n_read;
+	}
+  #ifdef STATS
+	stats::add(stats::BYTES_IN, offset);
+  #endif
+	return offset;
 }
+#endif
 
 
 namespace os {
 
 
-size_t extract_to_stdout(BPCSStreamBuf& bpcs_stream,  uchar io_buf[IO_BUF_SZ]){
+template<template<class> class Stream,  class G>
+void extract_to_stdout(Stream<G>& bpcs_stream,  uchar io_buf[io_buf_sz<G>]){
+	size_t io_buf_sz = ::io_buf_sz<G>;
+  #ifdef VMSPLICE_OUTPUT
+	// If stdout is a pipe, alternate between two buffers that are spliced into it, rather than copying io_buf into it
+	// The buffers are never freed, as the pipe may still refer to them
+	size_t vmsplice_buf_sz;
+	uchar* const vmsplice_bufs = alloc_vmsplice_bufs(vmsplice_buf_sz, G::n_bytes);
+	bool vmsplice_buf_n = 0;
+	if (vmsplice_bufs != nullptr){
+		io_buf = vmsplice_bufs;
+		io_buf_sz = (vmsplice_buf_sz / G::n_bytes) * G::n_bytes;
+	}
+  #endif
 	uchar* io_buf_itr = io_buf;
-	size_t count = 0;
 	while(true){
-#ifdef ONLY_COUNT
-		if (unlikely(bpcs_stream.exhausted))
-			break;
-		count += BYTES_PER_GRID;
-#endif
 		bpcs_stream.get(io_buf_itr);
-		io_buf_itr += BYTES_PER_GRID;
-#ifndef ONLY_COUNT
-		if (unlikely((io_buf_itr == io_buf + IO_BUF_SZ) or (bpcs_stream.exhausted))){
+		io_buf_itr += G::n_bytes;
+		if (unlikely((io_buf_itr == io_buf + io_buf_sz) or (bpcs_stream.exhausted))){
 			const size_t n_bytes = (uintptr_t)io_buf_itr - (uintptr_t)io_buf;
+		  #ifdef VMSPLICE_OUTPUT
+			if (vmsplice_bufs != nullptr){
+				vmsplice_to_stdout(io_buf, n_bytes);
+				vmsplice_buf_n = not vmsplice_buf_n;
+				io_buf = vmsplice_bufs  +  vmsplice_buf_n * vmsplice_buf_sz;
+			} else
+		  #endif
 			if (unlikely(write_to_stdout(io_buf, n_bytes)))
 				handler(COULD_NOT_WRITE_ENOUGH_BYTES_TO_STDOUT);
 			if (unlikely(bpcs_stream.exhausted))
 				break;
 			io_buf_itr = io_buf;
 		}
+	}
+}
+
+
+#ifdef RANDOM_ACCESS
+template<class G>
+void extract_range_to_stdout(BPCSStreamBuf<G>& bpcs_stream,  uchar io_buf[io_buf_sz<G>],  size_t n_bytes_to_skip,  uint64_t n_bytes){
+	// The stream must already have been seeked to the grid containing the first byte, which is n_bytes_to_skip bytes into it
+	uchar* io_buf_itr = io_buf;
+	while ((n_bytes != 0)  and  (not bpcs_stream.exhausted)){
+		bpcs_stream.get(io_buf_itr);
+		io_buf_itr += G::n_bytes;
+		size_t n_bytes_in_buf = (uintptr_t)io_buf_itr - (uintptr_t)io_buf - n_bytes_to_skip;
+		if (unlikely((io_buf_itr == io_buf + io_buf_sz<G>) or (bpcs_stream.exhausted) or (n_bytes_in_buf >= n_bytes))){
+			if (n_bytes_in_buf > n_bytes)
+				n_bytes_in_buf = n_bytes;
+			if (unlikely(write_to_stdout(io_buf + n_bytes_to_skip, n_bytes_in_buf)))
+				handler(COULD_NOT_WRITE_ENOUGH_BYTES_TO_STDOUT);
+			n_bytes -= n_bytes_in_buf;
+			n_bytes_to_skip = 0;
+			io_buf_itr = io_buf;
+		}
+	}
+}
+#endif
+
+
+#ifdef ENABLE_THREADS
+template<class G>
+void extract_to_stdout_threaded(BPCSStreamBuf<G>& bpcs_stream,  const unsigned n_threads){
+	// Each worker extracts whole bitplanes of the current image into their own section of out_buf, and this thread writes the sections to stdout in order as soon as they are complete.
+	std::mutex mutex;
+	std::condition_variable work_available;
+	std::condition_variable bitplane_done;
+	int n_bitplanes = 0;
+	int next_bitplane = 0;
+	bool stop = false;
+	std::vector<bool> is_done;
+	std::vector<size_t> offsets;
+	uchar* out_buf = nullptr;
+	size_t out_buf_sz = 0;
+	
+	std::vector<std::thread> workers;
+	for (unsigned i = 0;  i < n_threads;  ++i){
+		workers.emplace_back([&](){
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true){
+				work_available.wait(lock, [&](){ return stop or (next_bitplane != n_bitplanes); });
+				if (stop)
+					return;
+				const int bitplane_indx = next_bitplane++;
+				lock.unlock();
+				{
+				  #ifdef STATS
+					const stats::Timer timer(stats::GRIDS);
+				  #endif
+				  #ifdef TRACING
+					const trace::Span span("get_bitplane", trace::Args{nullptr, bitplane_indx});
+				  #endif
+					bpcs_stream.get_bitplane(bitplane_indx,  out_buf + offsets[bitplane_indx]);
+				}
+				lock.lock();
+				is_done[bitplane_indx] = true;
+				bitplane_done.notify_all();
+			}
+		});
+	}
+	
+	for (int img_n = bpcs_stream.img_n_offset;  img_n != bpcs_stream.n_imgs;  ++img_n){
+		// Workers are all idle at this point, so the image buffers can be replaced
+		bpcs_stream.decode_img(img_n);
+		
+		const int n = N_CHANNELS * bpcs_stream.n_bitplanes;
+		offsets.resize(n + 1);
+		offsets[0] = 0;
+		for (int i = 0;  i < n;  ++i)
+			offsets[i+1] = offsets[i] + bpcs_stream.get_bitplane_sz(i);
+		if (offsets[n] > out_buf_sz){
+			free(out_buf);
+			out_buf_sz = offsets[n];
+			out_buf = (uchar*)malloc(out_buf_sz);
+			if (unlikely(out_buf == nullptr))
+				handler(OOM);
+		}
+		
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			is_done.assign(n, false);
+			next_bitplane = 0;
+			n_bitplanes = n;
+		}
+		work_available.notify_all();
+		
+		for (int i = 0;  i < n;  ++i){
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				bitplane_done.wait(lock, [&](){ return is_done[i]; });
+			}
+			const size_t n_bytes = offsets[i+1] - offsets[i];
+			if (n_bytes == 0)
+				continue;
+			if (unlikely(write_to_stdout(out_buf + offsets[i], n_bytes)))
+				handler(COULD_NOT_WRITE_ENOUGH_BYTES_TO_STDOUT);
+		}
+	}
+	
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stop = true;
+	}
+	work_available.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+	free(out_buf);
+}
 #endif
+
+
+#if defined(ENABLE_THREADS) && defined(EMBEDDOR)
+template<class G>
+void embed_from_stdin_threaded(const unsigned min_complexity,  const int img_n_offset,  const int n_imgs,  char** img_fps,  char* out_fmt,  const png::WritePolicy& write_policy,  const unsigned n_threads){
+	/*
+	 * Each image is embedded independently, into a BPCSStreamBuf of its own.
+	 * This requires knowing the offset of each image's share of the stream, so the capacity of every image is first calculated, in parallel.
+	 * The results are identical to embedding the whole stream in series: every grid up to and including the one following the final byte is written, the final grid being padded with zeros (so a stream of a multiple of G::n_bytes bytes is followed by a grid of zeros), and every image up to the one containing the next unused grid is saved.
+	 */
+	const int n = n_imgs - img_n_offset;
+	std::vector<size_t> img_szs(n);
+	{
+		std::atomic<int> next_img(0);
+		std::vector<std::thread> workers;
+		for (unsigned i = 0;  i < n_threads;  ++i){
+			workers.emplace_back([&](){
+				// Each image is given a stream of its own, whose buffers are reused for the next
+				alloc::Pool pool;
+				for (int k = next_img++;  k < n;  k = next_img++){
+					BPCSStreamBuf<G> bpcs_stream(min_complexity, img_n_offset + k, img_n_offset + k + 1, img_fps, false, nullptr);
+					bpcs_stream.allocator = &pool.allocator;
+					bpcs_stream.decode_img(img_n_offset + k);
+					img_szs[k] = bpcs_stream.get_img_sz();
+				}
+			});
+		}
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+	
+	struct Job {
+		int img_n;
+		uchar* data;
+		size_t n_grids;
+	};
+	std::mutex mutex;
+	std::condition_variable queue_changed;
+	std::deque<Job> queue;
+	unsigned n_in_flight = 0; // Jobs queued or being embedded, whose shares are held in memory
+	bool stop = false;
+	
+	std::vector<std::thread> workers;
+	for (unsigned i = 0;  i < n_threads;  ++i){
+		workers.emplace_back([&](){
+			alloc::Pool pool;
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true){
+				queue_changed.wait(lock, [&](){ return stop or not queue.empty(); });
+				if (queue.empty())
+					return;
+				const Job job = queue.front();
+				queue.pop_front();
+				lock.unlock();
+				
+			  #ifdef STATS
+				const stats::Timer timer(stats::GRIDS);
+			  #endif
+				BPCSStreamBuf<G> bpcs_stream(min_complexity, job.img_n, job.img_n + 1, img_fps, true, out_fmt);
+				bpcs_stream.allocator = &pool.allocator;
+				bpcs_stream.exhaustion_is_error = false;
+				bpcs_stream.write_policy = write_policy;
+				bpcs_stream.write_policy.n_threads = 1; // The images are already written in parallel
+				bpcs_stream.load_next_img();
+				for (size_t j = 0;  j < job.n_grids;  ++j)
+					bpcs_stream.put(job.data  +  j * G::n_bytes);
+				bpcs_stream.save_im();
+				free(job.data);
+				
+				lock.lock();
+				--n_in_flight;
+				queue_changed.notify_all();
+			}
+		});
 	}
-	return count;
+	
+	auto enqueue = [&](const Job job){
+		std::unique_lock<std::mutex> lock(mutex);
+		// Limit the number of stream shares held in memory at once to n_threads, plus the one being read
+		queue_changed.wait(lock, [&](){ return n_in_flight < n_threads; });
+		++n_in_flight;
+		queue.push_back(job);
+		queue_changed.notify_all();
+	};
+	
+	// Following the final grid that is embedded, there must be one more grid, though it may be in a later image.
+	// The last image is only ever saved if the data fits, but other images are saved once the embedding moves past them.
+	bool fits = false;
+	for (int k = 0;  k < n;  ++k){
+		const size_t img_sz = img_szs[k];
+		const size_t img_n_grids = img_sz / G::n_bytes;
+		uchar* const data = (uchar*)malloc(img_sz);
+		if (unlikely((data == nullptr) and (img_sz != 0)))
+			handler(OOM);
+		size_t n_grids = img_n_grids;
+		bool reached_end_of_stream = false;
+		if (img_sz != 0){
+			const size_t n_bytes = read_up_to_n_bytes_from_stdin(data, img_sz);
+			if (n_bytes != img_sz){
+				memset(data + n_bytes,  0,  img_sz - n_bytes);
+				n_grids = n_bytes / G::n_bytes  +  1;
+				reached_end_of_stream = true;
+			}
+		}
+		
+		int last_img_to_save = k;
+		if (reached_end_of_stream){
+			if (n_grids < img_n_grids)
+				fits = true;
+			else {
+				// The grid following the final one is in the next image with any grids
+				for (last_img_to_save = k + 1;  last_img_to_save < n;  ++last_img_to_save){
+					if (img_szs[last_img_to_save] != 0){
+						fits = true;
+						break;
+					}
+				}
+				if (not fits)
+					last_img_to_save = n - 2;
+			}
+		} else if (k == n - 1)
+			// There is no room for at least the grid following the final one
+			last_img_to_save = n - 2;
+		
+		if (k <= last_img_to_save)
+			enqueue(Job{img_n_offset + k,  data,  n_grids});
+		else
+			free(data);
+		for (int j = k + 1;  j <= last_img_to_save;  ++j)
+			enqueue(Job{img_n_offset + j,  nullptr,  0});
+		
+		if (reached_end_of_stream)
+			break;
+	}
+	
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stop = true;
+	}
+	queue_changed.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+	
+	if (unlikely(not fits))
+		handler(TOO_MUCH_DATA_TO_ENCODE);
 }
+#endif
 
 
 #ifdef EMBEDDOR
-void embed_from_stdin(BPCSStreamBuf& bpcs_stream,  uchar io_buf[IO_BUF_SZ]){
-	uchar* io_buf_itr = io_buf;
-	while (likely(not read_from_stdin(io_buf))){
-		// TODO: Optimise
-		bpcs_stream.put(io_buf);
+template<template<class> class Stream,  class G>
+void embed_from_stdin(Stream<G>& bpcs_stream,  uchar io_buf[io_buf_sz<G>]){
+	// Reads as much of the stream as fits in io_buf at once, and embeds the grids straight out of it
+	while(true){
+		const size_t n_bytes = read_up_to_n_bytes_from_stdin(io_buf, io_buf_sz<G>);
+		uchar* io_buf_itr = io_buf;
+		uchar* const io_buf_end = io_buf  +  (n_bytes / G::n_bytes) * G::n_bytes;
+		for (;  io_buf_itr != io_buf_end;  io_buf_itr += G::n_bytes)
+			bpcs_stream.put(io_buf_itr);
+		if (n_bytes != io_buf_sz<G>){
+			// The final grid is padded with zeros, so is entirely zeros if the stream ended on a grid boundary
+			const size_t n_bytes_left = n_bytes % G::n_bytes;
+			memset(io_buf_itr + n_bytes_left,  0,  G::n_bytes - n_bytes_left);
+			bpcs_stream.put(io_buf_itr);
+			break;
+		}
 	}
-	bpcs_stream.put(io_buf);
     bpcs_stream.save_im();
 }
 #endif
 
 
+#define INSTANTIATE_EXTRACT(N) \
+	template void extract_to_stdout<BPCSStreamBuf, Grid<N, N>>(BPCSStreamBuf<Grid<N, N>>&,  uchar*);
+FOR_EACH_GRID_SIZE(INSTANTIATE_EXTRACT)
+#undef INSTANTIATE_EXTRACT
+#ifdef BAND_STREAMING
+# define INSTANTIATE_EXTRACT_BANDS(N) \
+	template void extract_to_stdout<BandStreamBuf, Grid<N, N>>(BandStreamBuf<Grid<N, N>>&,  uchar*);
+FOR_EACH_GRID_SIZE(INSTANTIATE_EXTRACT_BANDS)
+# undef INSTANTIATE_EXTRACT_BANDS
+#endif
+#ifdef RANDOM_ACCESS
+# define INSTANTIATE_EXTRACT_RANGE(N) \
+	template void extract_range_to_stdout<Grid<N, N>>(BPCSStreamBuf<Grid<N, N>>&,  uchar*,  size_t,  uint64_t);
+FOR_EACH_GRID_SIZE(INSTANTIATE_EXTRACT_RANGE)
+# undef INSTANTIATE_EXTRACT_RANGE
+#endif
+#ifdef ENABLE_THREADS
+# define INSTANTIATE_EXTRACT_THREADED(N) \
+	template void extract_to_stdout_threaded<Grid<N, N>>(BPCSStreamBuf<Grid<N, N>>&,  const unsigned);
+FOR_EACH_GRID_SIZE(INSTANTIATE_EXTRACT_THREADED)
+# undef INSTANTIATE_EXTRACT_THREADED
+#endif
+#ifdef EMBEDDOR
+# define INSTANTIATE_EMBED(N) \
+	template void embed_from_stdin<BPCSStreamBuf, Grid<N, N>>(BPCSStreamBuf<Grid<N, N>>&,  uchar*);
+FOR_EACH_GRID_SIZE(INSTANTIATE_EMBED)
+# undef INSTANTIATE_EMBED
+#endif
+#if defined(BAND_STREAMING) && defined(EMBEDDOR)
+# define INSTANTIATE_EMBED_BANDS(N) \
+	template void embed_from_stdin<BandStreamBuf, Grid<N, N>>(BandStreamBuf<Grid<N, N>>&,  uchar*);
+FOR_EACH_GRID_SIZE(INSTANTIATE_EMBED_BANDS)
+# undef INSTANTIATE_EMBED_BANDS
+#endif
+#if defined(ENABLE_THREADS) && defined(EMBEDDOR)
+# define INSTANTIATE_EMBED_THREADED(N) \
+	template void embed_from_stdin_threaded<Grid<N, N>>(const unsigned,  const int,  const int,  char**,  char*,  const png::WritePolicy&,  const unsigned);
+FOR_EACH_GRID_SIZE(INSTANTIATE_EMBED_THREADED)
+# undef INSTANTIATE_EMBED_THREADED
+#endif
+
+
 } // namespace os
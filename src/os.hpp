@@ -1,22 +1,49 @@
 #pragma once
 
 #include "bpcs.hpp"
+#ifdef BAND_STREAMING
+# include "band.hpp"
+#endif
 #ifdef _WIN32
 # include "windows.h"
 #endif
 
 
-#define DESIRED_IO_BUF_SZ (1024 * 64)
-#define IO_BUF_SZ ((DESIRED_IO_BUF_SZ / BYTES_PER_GRID) * BYTES_PER_GRID) // Ensure it is divisible by BYTES_PER_GRID
+#ifndef DESIRED_IO_BUF_SZ
+# define DESIRED_IO_BUF_SZ (1024 * 64)
+#endif
+
+
+template<class G>
+constexpr
+size_t io_buf_sz = (DESIRED_IO_BUF_SZ / G::n_bytes) * G::n_bytes; // Ensure it is divisible by G::n_bytes
 
 
 namespace os {
 
 
-size_t extract_to_stdout(BPCSStreamBuf& bpcs_stream,  uchar io_buf[IO_BUF_SZ]);
+template<template<class> class Stream,  class G>
+void extract_to_stdout(Stream<G>& bpcs_stream,  uchar io_buf[io_buf_sz<G>]);
+// Stream is BPCSStreamBuf, or BandStreamBuf
+
+#ifdef RANDOM_ACCESS
+template<class G>
+void extract_range_to_stdout(BPCSStreamBuf<G>& bpcs_stream,  uchar io_buf[io_buf_sz<G>],  size_t n_bytes_to_skip,  uint64_t n_bytes);
+#endif
+
+#ifdef ENABLE_THREADS
+template<class G>
+void extract_to_stdout_threaded(BPCSStreamBuf<G>& bpcs_stream,  const unsigned n_threads);
+#endif
 
 #ifdef EMBEDDOR
-void embed_from_stdin(BPCSStreamBuf& bpcs_stream,  uchar io_buf[IO_BUF_SZ]);
+template<template<class> class Stream,  class G>
+void embed_from_stdin(Stream<G>& bpcs_stream,  uchar io_buf[io_buf_sz<G>]);
+
+# ifdef ENABLE_THREADS
+template<class G>
+void embed_from_stdin_threaded(const unsigned min_complexity,  const int img_n_offset,  const int n_imgs,  char** img_fps,  char* out_fmt,  const png::WritePolicy& write_policy,  const unsigned n_threads);
+# endif
 #endif
 
 
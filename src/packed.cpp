@@ -0,0 +1,108 @@
+#include "packed.hpp"
+#include <compsky/macros/likely.hpp>
+#include <cstring> // for memset
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+
+namespace packed {
+
+
+MULTIVERSIONED
+void pack_bitplane(const uchar* src,  uint64_t* dst,  const uint32_t w,  const uint32_t h,  const size_t row_sz,  const unsigned bit_n){
+	for (uint32_t j = 0;  j < h;  ++j){
+		uint32_t i = 0;
+		uint64_t* word = dst;
+	  #ifdef __SSE2__
+		// Shift the wanted bit of each byte into its sign bit, and gather the sign bits 16 at a time
+		const __m128i shift = _mm_cvtsi32_si128(7 - bit_n);
+		for (;  i + 64 <= w;  i += 64){
+			uint64_t bits = 0;
+			for (unsigned k = 0;  k < 4;  ++k){
+				const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16*k));
+				bits |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_sll_epi64(v, shift)))) << (16*k);
+			}
+			*(word++) = bits;
+		}
+	  #endif
+		for (;  i < w;  i += 64){
+			uint64_t bits = 0;
+			const uint32_t n = (w - i < 64) ? (w - i) : 64;
+			for (uint32_t k = 0;  k < n;  ++k)
+				bits |= uint64_t((src[i + k] >> bit_n) & 1) << k;
+			*(word++) = bits;
+		}
+		src += w;
+		dst += row_sz;
+	}
+}
+
+
+template<class G>
+MULTIVERSIONED
+void find_complex_grids(const uint64_t* plane,  const uint32_t w,  const uint32_t h,  const size_t row_sz,  const unsigned min_complexity,  uint64_t* bitmap,  void* scratch){
+	static_assert(2 * G::w - 1 <= 64,  "The horizontal and vertical neighbours of a grid row must fit in a single word");
+	const size_t n_grids_hrztl = w / G::w;
+	const size_t n_grids_vrtcl = h / G::h;
+
+	memset(bitmap,  0,  get_bitmap_sz(n_grids_hrztl * n_grids_vrtcl) * sizeof(uint64_t));
+
+	// Laid out as get_scratch_sz describes
+	uint64_t* const hrztl = (uint64_t*)scratch; // Bit i is set iff elements i and i+1 of the row differ
+	uint64_t* const vrtcl = hrztl + row_sz; // Bit i is set iff element i of the row differs from element i of the next row
+	unsigned* const complexities = (unsigned*)(vrtcl + row_sz);
+
+	size_t grid_n = 0;
+	for (size_t gy = 0;  gy < n_grids_vrtcl;  ++gy){
+		memset(complexities,  0,  n_grids_hrztl * sizeof(unsigned));
+		const uint64_t* row = plane + gy * G::h * row_sz;
+		for (unsigned j = 0;  j < G::h;  ++j){
+			for (size_t k = 0;  k < row_sz - 1;  ++k)
+				hrztl[k] = row[k] ^ ((row[k] >> 1) | (row[k + 1] << 63));
+			hrztl[row_sz - 1] = row[row_sz - 1] ^ (row[row_sz - 1] >> 1);
+
+			if (j == G::h - 1){
+				for (size_t gx = 0;  gx < n_grids_hrztl;  ++gx)
+					complexities[gx] += __builtin_popcountll(get_bits(hrztl, gx * G::w, G::w - 1));
+			} else {
+				for (size_t k = 0;  k < row_sz;  ++k)
+					vrtcl[k] = row[k] ^ row[k + row_sz];
+				for (size_t gx = 0;  gx < n_grids_hrztl;  ++gx)
+					complexities[gx] += __builtin_popcountll(
+						  get_bits(hrztl, gx * G::w, G::w - 1)
+						| (get_bits(vrtcl, gx * G::w, G::w) << (G::w - 1))
+					);
+			}
+			row += row_sz;
+		}
+		for (size_t gx = 0;  gx < n_grids_hrztl;  ++gx,  ++grid_n)
+			if (complexities[gx] >= min_complexity)
+				bitmap[grid_n / 64] |= uint64_t(1) << (grid_n % 64);
+	}
+}
+
+
+size_t find_next_set_bit(const uint64_t* bitmap,  size_t i,  const size_t n_bits){
+	if (unlikely(i >= n_bits))
+		return n_bits;
+	size_t word_n = i / 64;
+	uint64_t word = bitmap[word_n] & (~uint64_t(0) << (i % 64));
+	const size_t n_words = get_bitmap_sz(n_bits);
+	while (word == 0){
+		if (++word_n == n_words)
+			return n_bits;
+		word = bitmap[word_n];
+	}
+	i = 64 * word_n + __builtin_ctzll(word);
+	return (i < n_bits) ? i : n_bits;
+}
+
+
+#define INSTANTIATE(N) \
+	template void find_complex_grids<Grid<N, N>>(const uint64_t*,  const uint32_t,  const uint32_t,  const size_t,  const unsigned,  uint64_t*,  void*);
+FOR_EACH_GRID_SIZE(INSTANTIATE)
+#undef INSTANTIATE
+
+
+} // namespace packed
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "typedefs.hpp"
+#include "grid.hpp"
+#include "cpu.hpp" // for ALWAYS_INLINE
+
+
+/*
+ * Packed bitplanes
+ * Each row of a bitplane is stored as ceil(w/64) 64-bit words, the element at column x being bit (x % 64) of word (x / 64).
+ * Bits past the width of the image are always 0.
+ */
+
+
+namespace packed {
+
+
+inline
+size_t get_row_sz(const uint32_t w){
+	return (w + 63) / 64;
+}
+
+inline
+size_t get_plane_sz(const uint32_t w,  const uint32_t h){
+	// In words
+	return get_row_sz(w) * h;
+}
+
+inline
+size_t get_bitmap_sz(const size_t n_bits){
+	return (n_bits + 63) / 64;
+}
+
+inline ALWAYS_INLINE
+uint64_t get_bits(const uint64_t* row,  const size_t offset,  const unsigned n){
+	// Bits [offset, offset+n) of the row, where n < 64
+	const size_t word_n = offset / 64;
+	const unsigned shift = offset % 64;
+	uint64_t bits = row[word_n] >> shift;
+	if (shift + n > 64)
+		// Never reads past the end of the row, as the bits requested are all within the image
+		bits |= row[word_n + 1] << (64 - shift);
+	return bits & ((uint64_t(1) << n) - 1);
+}
+
+inline ALWAYS_INLINE
+void set_bits(uint64_t* row,  const size_t offset,  const unsigned n,  const uint64_t bits){
+	// Overwrites bits [offset, offset+n) of the row with the n lowest bits of bits, where n < 64
+	const size_t word_n = offset / 64;
+	const unsigned shift = offset % 64;
+	const uint64_t mask = (uint64_t(1) << n) - 1;
+	row[word_n] = (row[word_n] & ~(mask << shift))  |  (bits << shift);
+	if (shift + n > 64)
+		row[word_n + 1] = (row[word_n + 1] & ~(mask >> (64 - shift)))  |  (bits >> (64 - shift));
+}
+
+
+void pack_bitplane(const uchar* src,  uint64_t* dst,  const uint32_t w,  const uint32_t h,  const size_t row_sz,  const unsigned bit_n);
+// Packs bit number bit_n of each byte of src (a w*h array) into dst
+
+template<class G>
+inline
+size_t get_scratch_sz(const uint32_t w){
+	// Bytes of scratch space that find_complex_grids needs for a bitplane of width w: two packed rows, then the complexities so far of a row of grids
+	return 2 * get_row_sz(w) * sizeof(uint64_t)  +  (w / G::w) * sizeof(unsigned);
+}
+
+template<class G>
+void find_complex_grids(const uint64_t* plane,  const uint32_t w,  const uint32_t h,  const size_t row_sz,  const unsigned min_complexity,  uint64_t* bitmap,  void* scratch);
+// Sets bit ((w/G::w) * j + i) of bitmap iff the complexity of the ith grid along and jth grid down is at least min_complexity
+// scratch is get_scratch_sz<G>(w) bytes aligned to 8 bytes, which are overwritten
+
+template<class G>
+inline ALWAYS_INLINE
+void unpack_grid(const uint64_t* plane,  const size_t row_sz,  const uint32_t x,  const uint32_t y,  uchar* grid){
+	// Copies the grid whose top-left corner is at (x, y) into an array of G::sz bytes
+	const uint64_t* row = plane + y * row_sz;
+	for (unsigned j = 0;  j < G::h;  ++j){
+		const uint64_t bits = get_bits(row, x, G::w);
+		for (unsigned i = 0;  i < G::w;  ++i)
+			grid[i] = (bits >> i) & 1;
+		grid += G::w;
+		row += row_sz;
+	}
+}
+
+template<class G>
+inline
+void pack_grid(const uchar* grid,  uint64_t* plane,  const size_t row_sz,  const uint32_t x,  const uint32_t y){
+	// Overwrites the grid whose top-left corner is at (x, y) with an array of G::sz bytes
+	uint64_t* row = plane + y * row_sz;
+	for (unsigned j = 0;  j < G::h;  ++j){
+		uint64_t bits = 0;
+		for (unsigned i = 0;  i < G::w;  ++i)
+			bits |= uint64_t(grid[i]) << i;
+		set_bits(row, x, G::w, bits);
+		grid += G::w;
+		row += row_sz;
+	}
+}
+
+size_t find_next_set_bit(const uint64_t* bitmap,  size_t i,  const size_t n_bits);
+// Returns n_bits if no bits from i onwards are set
+
+
+} // namespace packed
@@ -1,8 +1,20 @@
 #pragma once
 
 #include "errors.hpp"
+#include "alloc.hpp"
 #include <compsky/macros/likely.hpp>
 #include "typedefs.hpp"
+#include <cstring> // for strcmp
+#include <cstdio> // for fclose
+#ifdef MMAP_INPUT
+# include <fcntl.h> // for open, posix_fadvise
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h> // for close
+#endif
+#ifdef TRACING
+# include "trace.hpp"
+#endif
 #ifdef USE_LIBSPNG
 # include <spng.h>
 #else
@@ -10,24 +22,6 @@
 #endif
 
 
-inline
-void set_img_data_sz(uchar*& img_data, size_t& img_data_sz, const uint32_t img_width_by_height, const int n_imgs){
-	if (img_data_sz == 0){
-		img_data_sz = (N_CHANNELS + N_CHANNELS + 1) * img_width_by_height;
-		if (n_imgs != 1)
-			img_data_sz *= 2;
-		img_data = (uchar*)malloc(img_data_sz);
-	} else if (img_data_sz < img_width_by_height * N_CHANNELS){
-		img_data_sz = (N_CHANNELS + N_CHANNELS + 1) * img_width_by_height;
-		img_data = (uchar*)realloc(img_data,  2 * img_data_sz);
-	  #ifdef TESTS
-		if (unlikely(img_data == nullptr))
-			handler(OOM);
-	  #endif
-	}
-}
-
-
 namespace png {
 
 /*
@@ -60,38 +54,191 @@ void read(
 
 
 #else*/
+
+
 inline
-void read(
-	  const char* const fp
-	, const int n_imgs
-	, uchar*& img_data
-	, size_t& img_data_sz
+size_t get_img_data_sz(const uint32_t w,  const uint32_t h){
+	// Number of bytes of the buffer that an image is decoded into: its pixels, then the byteplane of each channel, then a bitplane
+	return (N_CHANNELS + N_CHANNELS + 1) * size_t(w) * h;
+}
+
+inline
+void check_img_data_sz(const size_t img_data_sz,  const uint32_t w,  const uint32_t h){
+	// The buffers of the stream are sized from the headers of its images before any is decoded, so are only too small if an image has since been replaced
+	if (unlikely(img_data_sz < get_img_data_sz(w, h)))
+		handler(VESSEL_CHANGED);
+}
+
+
+struct Header {
+	uint32_t w;
+	uint32_t h;
+	int n_bitplanes;
+};
+
+inline
+bool read_header_from_memory(const uchar* const buf,  const size_t buf_sz,  Header& header){
+	// Reads the dimensions from the IHDR chunk, which directly follows the signature. Returns false if buf does not begin with them.
+	constexpr static uchar signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if ((buf_sz < 8 + 8 + 9)  or  (memcmp(buf, signature, 8) != 0)  or  (memcmp(buf + 12, "IHDR", 4) != 0))
+		return false;
+	const auto get_u32 = [](const uchar* const p){
+		// Big-endian
+		return (uint32_t(p[0]) << 24)  |  (uint32_t(p[1]) << 16)  |  (uint32_t(p[2]) << 8)  |  uint32_t(p[3]);
+	};
+	header.w = get_u32(buf + 16);
+	header.h = get_u32(buf + 20);
+	header.n_bitplanes = buf[24];
+	return true;
+}
+
+inline
+bool read_header(const char* const fp,  Header& header){
+	// Reads only as much of the file as the header
+	uchar buf[8 + 8 + 9];
+	FILE* const f = fopen(fp, "rb");
+	if (f == nullptr)
+		return false;
+	const size_t n_bytes = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	return read_header_from_memory(buf, n_bytes, header);
+}
+
+
+enum {
+	// The PNG row filters, in the order of their filter type bytes
+	FILTER_NONE,
+	FILTER_SUB,
+	FILTER_UP,
+	FILTER_AVG,
+	FILTER_PAETH,
+	FILTER_ALL, // Choose the best filter for each row
+	N_FILTERS
+};
+
+struct WritePolicy {
+	// How images are compressed - a trade-off between the speed of writing them and their size
+	int level = 6; // zlib compression level, from 0 to 9. 0 stores the image data uncompressed, which is quickest for images that are only to be decoded again.
+	int filter = FILTER_ALL;
+	unsigned n_threads = 0; // Number of threads to compress each image with, if PARALLEL_DEFLATE. 0 for one per CPU.
+};
+
+inline
+int get_filter_from_name(const char* const name){
+	// Returns -1 if there is no such filter
+	constexpr static const char* const names[N_FILTERS] = {"none", "sub", "up", "avg", "paeth", "all"};
+	for (int i = 0;  i < N_FILTERS;  ++i)
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	return -1;
+}
+
+inline
+int get_filter_flags(const int filter){
+	// libpng's PNG_FILTER_* flags
+	return (filter == FILTER_ALL) ? 0xf8 : (0x08 << filter);
+}
+
+struct FileCloser {
+	// Closes the file however reading ends, as handler() throws in the library and the daemon
+	FILE* const f;
+	
+	~FileCloser(){
+		fclose(this->f);
+	}
+};
+
+#if defined(EMBEDDOR) && defined(PARALLEL_DEFLATE)
+void write(
+	  const char* const out_fp
+	, const png_color_16* const png_bg // nullptr if the image has no background colour
+	, const uchar* const img_data
+	, const uint32_t w
+	, const uint32_t h
+	, const int n_bitplanes
+	, const WritePolicy& policy
+	, const bpcs_allocator* const allocator // For the buffers that the image is encoded in
+);
+
+void write_to_memory(
+	  bpcs_buf& out // Set to the PNG file, allocated with allocator
+	, const png_color_16* const png_bg
+	, const uchar* const img_data
+	, const uint32_t w
+	, const uint32_t h
+	, const int n_bitplanes
+	, const WritePolicy& policy
+	, const bpcs_allocator* const allocator
+);
+#endif
+
+struct ReadStructs {
+	// Destroys the structs however decoding ends, as handler() throws in the library
+	png_structp png_ptr;
+	png_infop png_info_ptr;
+	
+	~ReadStructs(){
+		png_destroy_read_struct(&this->png_ptr, &this->png_info_ptr, nullptr);
+	}
+};
+
+
+#ifdef LIBBPCS
+inline
+void error_fn(png_structp png_ptr,  png_const_charp){
+	// The library only returns error codes, rather than printing
+	png_longjmp(png_ptr, 1);
+}
+
+inline
+void warning_fn(png_structp,  png_const_charp){}
+#else
+constexpr static
+const png_error_ptr error_fn = nullptr; // Prints the error
+constexpr static
+const png_error_ptr warning_fn = nullptr;
+#endif
+
+
+inline
+png_voidp malloc_fn(png_structp png_ptr,  png_alloc_size_t sz){
+	return alloc::malloc(reinterpret_cast<const bpcs_allocator*>(png_get_mem_ptr(png_ptr)),  sz);
+}
+
+inline
+void free_fn(png_structp png_ptr,  png_voidp ptr){
+	alloc::free(reinterpret_cast<const bpcs_allocator*>(png_get_mem_ptr(png_ptr)),  ptr);
+}
+
+
+struct MemoryReader {
+	const uchar* itr;
+	const uchar* end;
+};
+
+inline
+void read_from_memory_fn(png_structp png_ptr,  png_bytep out,  png_size_t n){
+	MemoryReader* const reader = reinterpret_cast<MemoryReader*>(png_get_io_ptr(png_ptr));
+	if (unlikely(n > size_t(reader->end - reader->itr)))
+		png_error(png_ptr, "Unexpected end of file");
+	memcpy(out, reader->itr, n);
+	reader->itr += n;
+}
+
+
+inline
+int read_info(
+	  const png_structp png_ptr
+	, const png_infop png_info_ptr
 	, unsigned& w
 	, unsigned& h
 	, int& n_bitplanes
 #ifdef EMBEDDOR
-	, png_color_16p& png_bg
+	, png_color_16& png_bg
+	, bool& has_png_bg
 #endif
 ){
-	FILE* png_file = fopen(fp, "rb");
-	static uchar png_sig[8];
-	
-	const size_t magic_number_length = fread(png_sig, 1, 8, png_file);
-	if (unlikely(magic_number_length != 8) or (png_check_sig(png_sig, 8) == 0))
-		handler(INVALID_PNG_MAGIC_NUMBER);
-    
-    auto png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-        // Could not allocate memory
-		handler(OOM);
-  
-    auto png_info_ptr = png_create_info_struct(png_ptr);
-    if (!png_info_ptr){
-        png_destroy_read_struct(&png_ptr, NULL, NULL);
-		handler(CANNOT_CREATE_PNG_READ_STRUCT);
-    }
-    
-    png_init_io(png_ptr, png_file);
+	// Reads the chunks before the image data, once the source of png_ptr has been set. Returns the number of passes that the rows are decoded in, which is 1 unless the image is interlaced.
     png_set_sig_bytes(png_ptr, 8);
     png_read_info(png_ptr, png_info_ptr);
 	
@@ -117,94 +264,398 @@ void read(
     #endif
     
     #ifdef EMBEDDOR
-	png_bg = nullptr;
-	png_get_bKGD(png_ptr, png_info_ptr, &png_bg);
+	// Copied, as png_get_bKGD points into png_info_ptr, which is destroyed before the image is written
+	png_color_16p _png_bg = nullptr;
+	png_get_bKGD(png_ptr, png_info_ptr, &_png_bg);
+	has_png_bg = (_png_bg != nullptr);
+	if (has_png_bg)
+		png_bg = *_png_bg;
     #endif
     
-    uint32_t rowbytes;
-    
+	const int n_passes = png_set_interlace_handling(png_ptr);
     png_read_update_info(png_ptr, png_info_ptr);
     
-    rowbytes = png_get_rowbytes(png_ptr, png_info_ptr);
-    
     #ifdef TESTS
 		if (unlikely(png_get_channels(png_ptr, png_info_ptr) != N_CHANNELS))
 			handler(WRONG_NUMBER_OF_CHANNELS);
     #endif
 	
-	set_img_data_sz(img_data,  img_data_sz,  w * h,  n_imgs);
-	
-	uchar* row_ptrs[h];
-    for (uint32_t i=0; i<h; ++i)
-        row_ptrs[i] = img_data + i*rowbytes;
+	return n_passes;
+}
+
+
+inline
+void read_png(
+	  void* const io_ptr
+	, png_rw_ptr read_fn // nullptr if io_ptr is a FILE*
+	, uchar* const img_data
+	, const size_t img_data_sz
+	, const bpcs_allocator* const allocator
+	, unsigned& w
+	, unsigned& h
+	, int& n_bitplanes
+#ifdef EMBEDDOR
+	, png_color_16& png_bg
+	, bool& has_png_bg
+#endif
+){
+	// Decodes the image following the signature
+	ReadStructs structs{png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, error_fn, warning_fn, const_cast<bpcs_allocator*>(allocator), malloc_fn, free_fn),  nullptr};
+	const png_structp png_ptr = structs.png_ptr;
+    if (!png_ptr)
+        // Could not allocate memory
+		handler(OOM);
+  
+	structs.png_info_ptr = png_create_info_struct(png_ptr);
+	const png_infop png_info_ptr = structs.png_info_ptr;
+    if (!png_info_ptr){
+		handler(CANNOT_CREATE_PNG_READ_STRUCT);
+    }
     
-    png_read_image(png_ptr, row_ptrs);
+    // No object with a destructor may be created after this, as jumping back here would skip it
+    if (setjmp(png_jmpbuf(png_ptr))){
+		handler(PNG_ERROR_1);
+    }
     
-    fclose(png_file);
-    png_destroy_read_struct(&png_ptr, &png_info_ptr, NULL);
+    png_set_read_fn(png_ptr, io_ptr, read_fn);
+	const int n_passes = read_info(png_ptr, png_info_ptr, w, h, n_bitplanes
+	  #ifdef EMBEDDOR
+		, png_bg, has_png_bg
+	  #endif
+	);
+	
+	check_img_data_sz(img_data_sz,  w,  h);
+	
+	// Row by row, rather than with png_read_image, which needs an array of h row pointers on the stack
+	const size_t rowbytes = png_get_rowbytes(png_ptr, png_info_ptr);
+	for (int pass = 0;  pass < n_passes;  ++pass)
+		for (uint32_t i = 0;  i < h;  ++i)
+			png_read_row(png_ptr,  img_data + i * rowbytes,  nullptr);
 }
 
 
+inline
+void read_from_memory(
+	  const uchar* const buf
+	, const size_t buf_sz
+	, uchar* const img_data
+	, const size_t img_data_sz
+	, const bpcs_allocator* const allocator
+	, unsigned& w
+	, unsigned& h
+	, int& n_bitplanes
+#ifdef EMBEDDOR
+	, png_color_16& png_bg
+	, bool& has_png_bg
+#endif
+){
+	if (unlikely(buf_sz < 8) or (png_sig_cmp(buf, 0, 8) != 0))
+		handler(INVALID_PNG_MAGIC_NUMBER);
+	MemoryReader reader{buf + 8,  buf + buf_sz};
+	read_png(&reader, read_from_memory_fn, img_data, img_data_sz, allocator, w, h, n_bitplanes
+	  #ifdef EMBEDDOR
+		, png_bg, has_png_bg
+	  #endif
+	);
+}
+
+
+#ifndef MMAP_INPUT
+inline
+void read(
+	  const char* const fp
+	, uchar* const img_data
+	, const size_t img_data_sz
+	, const bpcs_allocator* const allocator
+	, unsigned& w
+	, unsigned& h
+	, int& n_bitplanes
 #ifdef EMBEDDOR
+	, png_color_16& png_bg
+	, bool& has_png_bg
+#endif
+){
+  #ifdef TRACING
+	const trace::Span span("png::read", trace::Args{fp});
+  #endif
+	FILE* const png_file = fopen(fp, "rb");
+	if (unlikely(png_file == nullptr))
+		handler(COULD_NOT_OPEN_PNG_FILE);
+	const FileCloser file_closer{png_file};
+	uchar png_sig[8];
+	
+	const size_t magic_number_length = fread(png_sig, 1, 8, png_file);
+	if (unlikely(magic_number_length != 8) or (png_check_sig(png_sig, 8) == 0))
+		handler(INVALID_PNG_MAGIC_NUMBER);
+	
+	read_png(png_file, nullptr, img_data, img_data_sz, allocator, w, h, n_bitplanes
+	  #ifdef EMBEDDOR
+		, png_bg, has_png_bg
+	  #endif
+	);
+}
+#endif
+
+
+#ifdef BAND_STREAMING
+class RowReader {
+	// Decodes an image a row at a time, so that only the rows being processed need be in memory
+  public:
+	RowReader()
+	: png_file(nullptr)
+	, png_ptr(nullptr)
+	, png_info_ptr(nullptr)
+	{}
+	
+	~RowReader(){
+		this->close();
+	}
+	
+	uint32_t w;
+	uint32_t h;
+	int n_bitplanes;
+	size_t row_sz; // Number of bytes of each row
+  #ifdef EMBEDDOR
+	png_color_16 png_bg;
+	bool has_png_bg;
+  #endif
+	
+	void open(const char* const fp,  const bpcs_allocator* const allocator){
+		// Reads the chunks before the image data, closing the image that was open, if any
+		this->close();
+		this->png_file = fopen(fp, "rb");
+		if (unlikely(this->png_file == nullptr))
+			handler(COULD_NOT_OPEN_PNG_FILE);
+		uchar png_sig[8];
+		const size_t magic_number_length = fread(png_sig, 1, 8, this->png_file);
+		if (unlikely(magic_number_length != 8) or (png_check_sig(png_sig, 8) == 0))
+			handler(INVALID_PNG_MAGIC_NUMBER);
+		
+		this->png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, error_fn, warning_fn, const_cast<bpcs_allocator*>(allocator), malloc_fn, free_fn);
+		if (!this->png_ptr)
+			handler(OOM);
+		this->png_info_ptr = png_create_info_struct(this->png_ptr);
+		if (!this->png_info_ptr)
+			handler(CANNOT_CREATE_PNG_READ_STRUCT);
+		if (setjmp(png_jmpbuf(this->png_ptr)))
+			handler(PNG_ERROR_1);
+		png_set_read_fn(this->png_ptr, this->png_file, nullptr);
+		const int n_passes = read_info(this->png_ptr, this->png_info_ptr, this->w, this->h, this->n_bitplanes
+		  #ifdef EMBEDDOR
+			, this->png_bg, this->has_png_bg
+		  #endif
+		);
+		// The rows of an interlaced image are only complete after the last pass
+		if (unlikely(n_passes != 1))
+			handler(VESSEL_IS_INTERLACED);
+		this->row_sz = png_get_rowbytes(this->png_ptr, this->png_info_ptr);
+	}
+	
+	void read_row(uchar* const row){
+		// Decodes the next row into row, which holds row_sz bytes
+		if (setjmp(png_jmpbuf(this->png_ptr)))
+			handler(PNG_ERROR_2);
+		png_read_row(this->png_ptr, row, nullptr);
+	}
+	
+	void close(){
+		// The rows after the last that was read are never decoded
+		if (this->png_ptr != nullptr)
+			png_destroy_read_struct(&this->png_ptr, &this->png_info_ptr, nullptr);
+		if (this->png_file != nullptr)
+			fclose(this->png_file);
+		this->png_file = nullptr;
+		this->png_ptr = nullptr;
+		this->png_info_ptr = nullptr;
+	}
+  private:
+	FILE* png_file;
+	png_structp png_ptr;
+	png_infop png_info_ptr;
+};
+#endif
+
+
+#if defined(EMBEDDOR) && (defined(BAND_STREAMING) || !defined(PARALLEL_DEFLATE))
+class RowWriter {
+	// Encodes an image a row at a time, so that it need not all be in memory at once
+  public:
+	RowWriter()
+	: png_file(nullptr)
+	, png_ptr(nullptr)
+	, png_info_ptr(nullptr)
+	{}
+	
+	~RowWriter(){
+		this->destroy();
+	}
+	
+	void open(
+		  const char* const out_fp
+		, const png_color_16* const png_bg // nullptr if the image has no background colour
+		, const uint32_t w
+		, const uint32_t h
+		, const int n_bitplanes
+		, const WritePolicy& policy
+		, const bpcs_allocator* const allocator
+	){
+		// Writes the chunks before the image data
+		this->png_file = fopen(out_fp, "wb");
+		this->png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, error_fn, warning_fn, const_cast<bpcs_allocator*>(allocator), malloc_fn, free_fn);
+		
+	  #ifdef TESTS
+		if (!this->png_file){
+			handler(COULD_NOT_OPEN_PNG_FILE);
+		}
+		if (!this->png_ptr){
+			handler(OOM);
+		}
+	  #endif
+		
+		this->png_info_ptr = png_create_info_struct(this->png_ptr);
+		
+		if (!this->png_info_ptr){
+			handler(CANNOT_CREATE_PNG_INFO_STRUCT);
+		}
+		
+		if (setjmp(png_jmpbuf(this->png_ptr))){
+			handler(PNG_ERROR_1);
+		}
+		
+		png_init_io(this->png_ptr, this->png_file);
+		
+		if (setjmp(png_jmpbuf(this->png_ptr))){
+			handler(PNG_ERROR_2);
+		}
+		
+		if (png_bg != nullptr)
+			png_set_bKGD(this->png_ptr, this->png_info_ptr, png_bg);
+		
+		png_set_IHDR(this->png_ptr, this->png_info_ptr, w, h, n_bitplanes, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_set_compression_level(this->png_ptr, policy.level);
+		png_set_filter(this->png_ptr, PNG_FILTER_TYPE_BASE, get_filter_flags(policy.filter));
+		
+		png_write_info(this->png_ptr, this->png_info_ptr);
+	}
+	
+	void write_row(const uchar* const row){
+		if (setjmp(png_jmpbuf(this->png_ptr))){
+			handler(PNG_ERROR_3);
+		}
+		png_write_row(this->png_ptr, row);
+	}
+	
+	void close(){
+		// Finishes the image, once every row has been written
+		if (setjmp(png_jmpbuf(this->png_ptr))){
+			handler(PNG_ERROR_4);
+		}
+		png_write_end(this->png_ptr, NULL);
+		this->destroy();
+	}
+  private:
+	FILE* png_file;
+	png_structp png_ptr;
+	png_infop png_info_ptr;
+	
+	void destroy(){
+		if (this->png_ptr != nullptr)
+			png_destroy_write_struct(&this->png_ptr, &this->png_info_ptr);
+		if (this->png_file != nullptr)
+			fclose(this->png_file);
+		this->png_file = nullptr;
+		this->png_ptr = nullptr;
+		this->png_info_ptr = nullptr;
+	}
+};
+#endif
+
+
+#if defined(EMBEDDOR) && !defined(PARALLEL_DEFLATE)
 inline
 void write(
 	  const char* const out_fp
-	, png_color_16p& png_bg
+	, const png_color_16* const png_bg // nullptr if the image has no background colour
 	, const uchar* const img_data
 	, const uint32_t w
 	, const uint32_t h
 	, const int n_bitplanes
+	, const WritePolicy& policy
+	, const bpcs_allocator* const allocator
 ){
-	FILE* png_file = fopen(out_fp, "wb");
-    auto png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    
-    #ifdef TESTS
-    if (!png_file){
+  #ifdef TRACING
+	const trace::Span span("png::write", trace::Args{out_fp});
+  #endif
+	RowWriter writer;
+	writer.open(out_fp, png_bg, w, h, n_bitplanes, policy, allocator);
+	// Row by row, rather than with png_write_image, which needs an array of h row pointers on the stack
+	for (uint32_t i = 0;  i < h;  ++i)
+		writer.write_row(img_data  +  i * (N_CHANNELS * size_t(w)));
+	writer.close();
+}
+#endif
+
+
+#ifdef MMAP_INPUT
+struct Mapping {
+	// Unmaps the file however reading ends
+	void* const buf;
+	const size_t sz;
+	
+	~Mapping(){
+		munmap(this->buf, this->sz);
+	}
+};
+
+inline
+void read(
+	  const char* const fp
+	, uchar* const img_data
+	, const size_t img_data_sz
+	, const bpcs_allocator* const allocator
+	, unsigned& w
+	, unsigned& h
+	, int& n_bitplanes
+#ifdef EMBEDDOR
+	, png_color_16& png_bg
+	, bool& has_png_bg
+#endif
+){
+  #ifdef TRACING
+	const trace::Span span("png::read", trace::Args{fp});
+  #endif
+	// The file is mapped rather than read, which avoids stdio's copies and its many small reads
+	const int fd = open(fp, O_RDONLY);
+	if (unlikely(fd == -1))
 		handler(COULD_NOT_OPEN_PNG_FILE);
-    }
-    if (!png_ptr){
-		handler(OOM);
-    }
-    #endif
-    
-    auto png_info_ptr = png_create_info_struct(png_ptr);
-    
-    if (!png_info_ptr){
-		handler(CANNOT_CREATE_PNG_INFO_STRUCT);
-    }
-    
-    if (setjmp(png_jmpbuf(png_ptr))){
-		handler(PNG_ERROR_1);
-    }
-    
-    png_init_io(png_ptr, png_file);
-    
-    if (setjmp(png_jmpbuf(png_ptr))){
-		handler(PNG_ERROR_2);
-    }
-    
-	if (png_bg != nullptr)
-		png_set_bKGD(png_ptr, png_info_ptr, png_bg);
-    
-	png_set_IHDR(png_ptr, png_info_ptr, w, h, n_bitplanes, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    
-    png_write_info(png_ptr, png_info_ptr);
-    
-    if (setjmp(png_jmpbuf(png_ptr))){
-		handler(PNG_ERROR_3);
-    }
-    
-	const uchar* row_ptrs[h];
-    for (uint32_t i=0; i<h; ++i)
-        row_ptrs[i] = img_data + i*N_CHANNELS*w;
-    
-    png_write_image(png_ptr, const_cast<unsigned char**>(row_ptrs));
-    
-    if (setjmp(png_jmpbuf(png_ptr))){
-		handler(PNG_ERROR_4);
-    }
-    
-    png_write_end(png_ptr, NULL);
+	struct stat st;
+	const bool is_stat = (fstat(fd, &st) == 0);
+	void* const buf = (is_stat and (st.st_size != 0)) ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (unlikely(not is_stat))
+		handler(COULD_NOT_STAT_FILE);
+	if (unlikely(st.st_size == 0))
+		handler(INVALID_PNG_MAGIC_NUMBER);
+	if (unlikely(buf == MAP_FAILED))
+		handler(COULD_NOT_OPEN_PNG_FILE);
+	const Mapping mapping{buf, size_t(st.st_size)};
+	madvise(buf, st.st_size, MADV_SEQUENTIAL);
+	madvise(buf, st.st_size, MADV_WILLNEED);
+	read_from_memory((const uchar*)buf, st.st_size, img_data, img_data_sz, allocator, w, h, n_bitplanes
+	  #ifdef EMBEDDOR
+		, png_bg, has_png_bg
+	  #endif
+	);
+}
+
+inline
+void prefetch(const char* const fp){
+	// Hints that the file will soon be read, so that it is read ahead of time
+	const int fd = open(fp, O_RDONLY);
+	if (fd == -1)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
 }
 #endif
 
@@ -0,0 +1,456 @@
+#include "png.hpp"
+#include <zlib.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory> // for std::unique_ptr
+#include <cstdio> // for fopen
+#include <cstdlib> // for abs
+#include <utility> // for std::swap
+#ifdef __SSSE3__
+# include <tmmintrin.h>
+#endif
+#ifdef STATS
+# include "stats.hpp"
+#endif
+#ifdef TRACING
+# include "trace.hpp"
+#endif
+
+
+/*
+ * PNG writer that filters and deflates the image data on multiple threads
+ * The filtered image data is split into chunks that are deflated independently, each being primed with the 32KiB of data before it (as pigz does), and ending on a byte boundary (using Z_SYNC_FLUSH) so that they can simply be concatenated.
+ * The zlib header and the Adler-32 checksum, which is combined from the checksums of the chunks, are added around them.
+ */
+
+
+namespace png {
+
+
+constexpr static
+const size_t chunk_sz = 256 * 1024; // Minimum number of bytes of filtered image data in each chunk
+constexpr static
+const size_t dict_sz = 32 * 1024; // The size of the deflate window
+constexpr static
+const size_t n_bytes_before_chunk = 2; // For the zlib header, in the first chunk
+constexpr static
+const size_t n_bytes_after_chunk = 4; // For the Adler-32 checksum, in the last chunk
+constexpr static
+const size_t n_bytes_around_png_chunk = 12; // Its length, type and CRC
+
+constexpr static
+const uchar signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+
+struct Chunk {
+	size_t begin; // Offset into the filtered image data
+	size_t end;
+	uchar* buf; // The deflated data, after n_bytes_before_chunk bytes of headroom
+	size_t sz; // Number of deflated bytes
+	uLong adler;
+};
+
+
+struct Idat {
+	// The deflated image data, in the chunks that are each written as an IDAT chunk
+	const bpcs_allocator* const allocator;
+	std::vector<Chunk> chunks;
+	
+	~Idat(){
+		for (Chunk& chunk : this->chunks)
+			alloc::free(this->allocator, chunk.buf);
+	}
+};
+
+
+struct Output {
+	// Either a file, or a buffer that the whole image fits in
+	FILE* const f;
+	uchar* itr;
+	
+	void put(const void* const data,  const size_t sz){
+		if (this->f == nullptr){
+			memcpy(this->itr, data, sz);
+			this->itr += sz;
+		} else if (unlikely(fwrite(data, sz, 1, this->f) != 1))
+			handler(PNG_ERROR_4);
+	}
+};
+
+
+inline
+uchar paeth(const uchar a,  const uchar b,  const uchar c){
+	// Written without branches, so that it can be vectorised
+	const int pa = abs(int(b) - int(c));
+	const int pb = abs(int(a) - int(c));
+	const int pc = abs(int(a) + int(b) - 2*int(c));
+	const uchar b_or_c = (pb <= pc) ? b : c;
+	return ((pa <= pb) & (pa <= pc)) ? a : b_or_c;
+}
+
+
+static
+void filter_row(const uchar* const row,  const uchar* prev_row,  const size_t row_sz,  const unsigned bpp,  const int filter,  uchar* const out){
+	// prev_row is nullptr for the first row, which is filtered as if it followed a row of zeros
+	out[0] = filter;
+	uchar* const dst = out + 1;
+	if (prev_row == nullptr){
+		if ((filter == FILTER_NONE) or (filter == FILTER_UP)){
+			memcpy(dst, row, row_sz);
+			return;
+		}
+		if (filter == FILTER_PAETH){
+			// Equivalent to the sub filter
+			filter_row(row, nullptr, row_sz, bpp, FILTER_SUB, out);
+			out[0] = filter;
+			return;
+		}
+	}
+	switch(filter){
+		case FILTER_NONE:
+			memcpy(dst, row, row_sz);
+			break;
+		case FILTER_SUB:
+			memcpy(dst, row, bpp);
+			for (size_t i = bpp;  i < row_sz;  ++i)
+				dst[i] = row[i] - row[i - bpp];
+			break;
+		case FILTER_UP:
+			for (size_t i = 0;  i < row_sz;  ++i)
+				dst[i] = row[i] - prev_row[i];
+			break;
+		case FILTER_AVG:
+			if (prev_row == nullptr){
+				memcpy(dst, row, bpp);
+				for (size_t i = bpp;  i < row_sz;  ++i)
+					dst[i] = row[i] - (row[i - bpp] / 2);
+				break;
+			}
+			for (size_t i = 0;  i < bpp;  ++i)
+				dst[i] = row[i] - (prev_row[i] / 2);
+			for (size_t i = bpp;  i < row_sz;  ++i)
+				dst[i] = row[i] - uchar((unsigned(row[i - bpp]) + unsigned(prev_row[i])) / 2);
+			break;
+		case FILTER_PAETH:
+			for (size_t i = 0;  i < bpp;  ++i)
+				dst[i] = row[i] - prev_row[i];
+			for (size_t i = bpp;  i < row_sz;  ++i)
+				dst[i] = row[i] - paeth(row[i - bpp], prev_row[i], prev_row[i - bpp]);
+			break;
+	}
+}
+
+
+static
+size_t get_filtered_row_cost(const uchar* const out,  const size_t row_sz,  const size_t max_cost){
+	// The heuristic that libpng uses: the sum of the magnitudes of the bytes, as signed bytes
+	// Gives up once the sum exceeds max_cost, as the row will not be used
+	size_t sum = 0;
+	size_t i = 1;
+  #ifdef __SSSE3__
+	for (;  i + 64 <= row_sz + 1;  i += 64){
+		__m128i acc = _mm_setzero_si128();
+		for (unsigned j = 0;  j < 64;  j += 16)
+			acc = _mm_add_epi64(acc,  _mm_sad_epu8(_mm_abs_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(out + i + j))),  _mm_setzero_si128()));
+		sum += _mm_cvtsi128_si64(acc) + _mm_extract_epi16(acc, 4);
+		if (sum >= max_cost)
+			return sum;
+	}
+  #endif
+	for (;  i <= row_sz;  ++i)
+		sum += (out[i] < 128) ? out[i] : 256 - out[i];
+	return sum;
+}
+
+
+static
+void filter_rows(const uchar* const img_data,  const uint32_t begin,  const uint32_t end,  const size_t row_sz,  const unsigned bpp,  const int filter,  const bpcs_allocator* const allocator,  uchar* const filtered){
+	// The best filtered row so far, and the row being tried
+	const std::unique_ptr<uchar, alloc::Deleter> _trials((filter == FILTER_ALL) ? (uchar*)alloc::malloc(allocator, 2 * (row_sz + 1)) : nullptr,  alloc::Deleter{allocator});
+	uchar* const trials = _trials.get();
+	if (unlikely((filter == FILTER_ALL) and (trials == nullptr)))
+		handler(OOM);
+	for (uint32_t j = begin;  j < end;  ++j){
+		const uchar* const row = img_data + j * row_sz;
+		const uchar* const prev_row = (j == 0) ? nullptr : row - row_sz;
+		uchar* const out = filtered + j * (row_sz + 1);
+		if (filter != FILTER_ALL){
+			filter_row(row, prev_row, row_sz, bpp, filter, out);
+			continue;
+		}
+		uchar* best = trials;
+		uchar* trial = trials + row_sz + 1;
+		size_t min_cost = SIZE_MAX;
+		for (int f = FILTER_NONE;  f < FILTER_ALL;  ++f){
+			filter_row(row, prev_row, row_sz, bpp, f, trial);
+			const size_t cost = get_filtered_row_cost(trial, row_sz, min_cost);
+			if (cost < min_cost){
+				min_cost = cost;
+				std::swap(best, trial);
+			}
+		}
+		memcpy(out,  best,  row_sz + 1);
+	}
+}
+
+
+static
+voidpf zlib_alloc(voidpf allocator,  uInt n,  uInt sz){
+	return alloc::malloc(reinterpret_cast<const bpcs_allocator*>(allocator),  size_t(n) * sz);
+}
+
+static
+void zlib_free(voidpf allocator,  voidpf ptr){
+	alloc::free(reinterpret_cast<const bpcs_allocator*>(allocator),  ptr);
+}
+
+
+static
+void deflate_chunk(const uchar* const filtered,  const bool is_last,  const WritePolicy& policy,  const bpcs_allocator* const allocator,  Chunk& chunk){
+	const size_t n = chunk.end - chunk.begin;
+	z_stream strm = {};
+	strm.zalloc = zlib_alloc;
+	strm.zfree = zlib_free;
+	strm.opaque = const_cast<bpcs_allocator*>(allocator);
+	if (unlikely(deflateInit2(&strm,  policy.level,  Z_DEFLATED,  -15,  8,  (policy.filter == FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK))
+		// Raw deflate, as the chunks are joined into a single zlib stream
+		handler(PNG_ERROR_3);
+	if ((chunk.begin != 0)  and  (policy.level != 0)){
+		const size_t sz = (chunk.begin < dict_sz) ? chunk.begin : dict_sz;
+		deflateSetDictionary(&strm,  filtered + chunk.begin - sz,  sz);
+	}
+
+	// deflateBound assumes Z_FINISH, and a sync flush adds an empty stored block
+	size_t buf_sz = deflateBound(&strm, n) + 16;
+	chunk.buf = (uchar*)alloc::malloc(allocator,  n_bytes_before_chunk + buf_sz + n_bytes_after_chunk);
+	if (unlikely(chunk.buf == nullptr)){
+		deflateEnd(&strm);
+		handler(OOM);
+	}
+	strm.next_in = const_cast<uchar*>(filtered + chunk.begin);
+	strm.avail_in = n;
+	strm.next_out = chunk.buf + n_bytes_before_chunk;
+	strm.avail_out = buf_sz;
+	const int rc = deflate(&strm,  (is_last) ? Z_FINISH : Z_SYNC_FLUSH);
+	const bool is_ok = ((rc == ((is_last) ? Z_STREAM_END : Z_OK))  and  (strm.avail_in == 0)  and  (strm.avail_out != 0));
+	chunk.sz = buf_sz - strm.avail_out;
+	chunk.adler = adler32(adler32(0, Z_NULL, 0),  filtered + chunk.begin,  n);
+	deflateEnd(&strm);
+	if (unlikely(not is_ok))
+		handler(PNG_ERROR_3);
+}
+
+
+inline
+void put_u32(uchar* const dst,  const uint32_t n){
+	dst[0] = n >> 24;
+	dst[1] = n >> 16;
+	dst[2] = n >> 8;
+	dst[3] = n;
+}
+
+
+static
+void write_chunk(Output& out,  const char* const type,  const uchar* const data,  const uint32_t sz){
+	uchar buf[8];
+	put_u32(buf, sz);
+	memcpy(buf + 4,  type,  4);
+	uLong crc = crc32(0, Z_NULL, 0);
+	crc = crc32(crc,  buf + 4,  4);
+	if (sz != 0)
+		// A null buffer would reset the CRC
+		crc = crc32(crc,  data,  sz);
+	uchar crc_buf[4];
+	put_u32(crc_buf, crc);
+	out.put(buf, 8);
+	if (sz != 0)
+		out.put(data, sz);
+	out.put(crc_buf, 4);
+}
+
+
+template<typename Fn>
+void run_on_threads(const unsigned n_threads,  const size_t n_jobs,  Fn fn){
+	// Calls fn(i) for every job i, on up to n_threads threads
+	std::atomic<size_t> next_job(0);
+	auto worker = [&](){
+	  #ifdef STATS
+		const stats::Timer timer(stats::ENCODE);
+	  #endif
+		for (size_t i = next_job++;  i < n_jobs;  i = next_job++)
+			fn(i);
+	};
+	std::vector<std::thread> threads;
+	for (unsigned i = 1;  (i < n_threads) and (i < n_jobs);  ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+
+static
+void deflate_img(
+	  const uchar* const img_data
+	, const uint32_t w
+	, const uint32_t h
+	, const int n_bitplanes
+	, const WritePolicy& policy
+	, Idat& idat
+){
+	const bpcs_allocator* const allocator = idat.allocator;
+	const unsigned bpp = N_CHANNELS * ((n_bitplanes + 7) / 8); // Bytes per pixel
+	const size_t row_sz = size_t(w) * bpp;
+	const size_t filtered_sz = (row_sz + 1) * h;
+	unsigned n_threads = (policy.n_threads != 0) ? policy.n_threads : std::thread::hardware_concurrency();
+	if (n_threads == 0)
+		n_threads = 1;
+
+	const std::unique_ptr<uchar, alloc::Deleter> _filtered((uchar*)alloc::malloc(allocator, filtered_sz),  alloc::Deleter{allocator});
+	uchar* const filtered = _filtered.get();
+	if (unlikely(filtered == nullptr))
+		handler(OOM);
+	const uint32_t rows_per_thread = (h + n_threads - 1) / n_threads;
+	run_on_threads(n_threads,  n_threads,  [&](const size_t i){
+		const uint32_t begin = i * rows_per_thread;
+		const uint32_t end = (begin + rows_per_thread < h) ? begin + rows_per_thread : h;
+		if (begin < end)
+			filter_rows(img_data, begin, end, row_sz, bpp, policy.filter, allocator, filtered);
+	});
+
+	// Chunks are whole rows, so the image is divided the same way whatever its width
+	const size_t rows_per_chunk = (chunk_sz + row_sz) / (row_sz + 1);
+	const size_t n_chunks = (h == 0) ? 1 : (h + rows_per_chunk - 1) / rows_per_chunk;
+	std::vector<Chunk>& chunks = idat.chunks;
+	chunks.resize(n_chunks);
+	for (size_t i = 0;  i < n_chunks;  ++i){
+		chunks[i].begin = i * rows_per_chunk * (row_sz + 1);
+		chunks[i].end = (i + 1 == n_chunks) ? filtered_sz : (i + 1) * rows_per_chunk * (row_sz + 1);
+	}
+	run_on_threads(n_threads,  n_chunks,  [&](const size_t i){
+		deflate_chunk(filtered,  (i + 1 == n_chunks),  policy,  allocator,  chunks[i]);
+	});
+
+	// The zlib header
+	constexpr uchar cmf = 0x78; // Deflate, with a 32KiB window
+	const uchar flevel = (policy.level <= 1) ? 0 : (policy.level <= 5) ? 1 : (policy.level == 6) ? 2 : 3;
+	uchar flg = flevel << 6;
+	flg += 31 - ((cmf * 256 + flg) % 31);
+	chunks[0].buf[0] = cmf;
+	chunks[0].buf[1] = flg;
+
+	uLong adler = adler32(0, Z_NULL, 0);
+	for (const Chunk& chunk : chunks)
+		adler = adler32_combine(adler,  chunk.adler,  chunk.end - chunk.begin);
+	Chunk& last_chunk = chunks[n_chunks - 1];
+	put_u32(last_chunk.buf + n_bytes_before_chunk + last_chunk.sz,  adler);
+	last_chunk.sz += n_bytes_after_chunk;
+}
+
+
+static
+size_t get_png_sz(const png_color_16* const png_bg,  const Idat& idat){
+	size_t sz = sizeof(signature)  +  (n_bytes_around_png_chunk + 13)  +  n_bytes_around_png_chunk; // With IHDR and IEND
+	if (png_bg != nullptr)
+		sz += n_bytes_around_png_chunk + 6;
+	for (const Chunk& chunk : idat.chunks)
+		sz += n_bytes_around_png_chunk + chunk.sz;
+	return sz + n_bytes_before_chunk;
+}
+
+
+static
+void write_png(
+	  Output& out
+	, const png_color_16* const png_bg
+	, const uint32_t w
+	, const uint32_t h
+	, const int n_bitplanes
+	, const Idat& idat
+){
+	out.put(signature, sizeof(signature));
+
+	uchar ihdr[13];
+	put_u32(ihdr, w);
+	put_u32(ihdr + 4, h);
+	ihdr[8] = n_bitplanes;
+	ihdr[9] = 2; // Truecolour
+	ihdr[10] = 0; // Deflate
+	ihdr[11] = 0; // Adaptive filtering, with the five basic filters
+	ihdr[12] = 0; // Not interlaced
+	write_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+	if (png_bg != nullptr){
+		uchar bkgd[6] = {
+			uchar(png_bg->red >> 8),    uchar(png_bg->red),
+			uchar(png_bg->green >> 8),  uchar(png_bg->green),
+			uchar(png_bg->blue >> 8),   uchar(png_bg->blue)
+		};
+		write_chunk(out, "bKGD", bkgd, sizeof(bkgd));
+	}
+
+	// Each chunk is written as its own IDAT chunk, the image data being the concatenation of them
+	for (size_t i = 0;  i < idat.chunks.size();  ++i){
+		const Chunk& chunk = idat.chunks[i];
+		if (i == 0)
+			write_chunk(out, "IDAT", chunk.buf, n_bytes_before_chunk + chunk.sz);
+		else
+			write_chunk(out, "IDAT", chunk.buf + n_bytes_before_chunk, chunk.sz);
+	}
+
+	write_chunk(out, "IEND", nullptr, 0);
+}
+
+
+void write(
+	  const char* const out_fp
+	, const png_color_16* const png_bg
+	, const uchar* const img_data
+	, const uint32_t w
+	, const uint32_t h
+	, const int n_bitplanes
+	, const WritePolicy& policy
+	, const bpcs_allocator* const allocator
+){
+  #ifdef TRACING
+	const trace::Span span("png::write", trace::Args{out_fp});
+  #endif
+	Idat idat{allocator,  {}};
+	deflate_img(img_data, w, h, n_bitplanes, policy, idat);
+
+	FILE* const png_file = fopen(out_fp, "wb");
+	if (unlikely(png_file == nullptr))
+		handler(COULD_NOT_OPEN_PNG_FILE);
+	Output out{png_file,  nullptr};
+	write_png(out, png_bg, w, h, n_bitplanes, idat);
+	fclose(png_file);
+}
+
+
+void write_to_memory(
+	  bpcs_buf& out_buf
+	, const png_color_16* const png_bg
+	, const uchar* const img_data
+	, const uint32_t w
+	, const uint32_t h
+	, const int n_bitplanes
+	, const WritePolicy& policy
+	, const bpcs_allocator* const allocator
+){
+	Idat idat{allocator,  {}};
+	deflate_img(img_data, w, h, n_bitplanes, policy, idat);
+
+	// The size of the file is known once the image is deflated, so it is written straight into a buffer of that size
+	const size_t sz = get_png_sz(png_bg, idat);
+	uchar* const buf = (uchar*)alloc::malloc(allocator, sz);
+	if (unlikely(buf == nullptr))
+		handler(OOM);
+	Output out{nullptr,  buf};
+	write_png(out, png_bg, w, h, n_bitplanes, idat);
+	out_buf.data = buf;
+	out_buf.sz = sz;
+}
+
+
+} // namespace png
@@ -0,0 +1,168 @@
+#include "stats.hpp"
+#include "json.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib> // for atexit
+#include <cstring> // for strcmp
+#include <map>
+#include <mutex>
+#include <string>
+#include <ctime> // for clock_gettime
+#include <sys/stat.h>
+
+
+namespace stats {
+
+
+bool is_enabled = false;
+std::atomic<uint64_t> counters[N_COUNTERS];
+
+
+struct Clock {
+	uint64_t wall_ns;
+	uint64_t cpu_ns; // Of the thread
+
+	static
+	Clock now(){
+		struct timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return Clock{
+			  uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count())
+			, uint64_t(ts.tv_sec) * 1000000000  +  ts.tv_nsec
+		};
+	}
+};
+
+struct Img {
+	std::string fp;
+	uint32_t w;
+	uint32_t h;
+	int n_bitplanes;
+	int64_t capacity;
+};
+
+
+static const char* program;
+static const char* out_fp;
+static uint64_t start_wall_ns;
+static std::atomic<uint64_t> stage_wall_ns[N_STAGES];
+static std::atomic<uint64_t> stage_cpu_ns[N_STAGES];
+static std::mutex imgs_mutex;
+static std::map<int, Img> imgs;
+
+static thread_local Stage current_stage = N_STAGES; // N_STAGES when in no stage
+static thread_local Clock stage_start;
+
+static const char* const stage_names[N_STAGES] = {
+	"read_input",
+	"decode",
+	"split",
+	"complexities",
+	"grids",
+	"merge",
+	"encode",
+	"write_output"
+};
+static const char* const counter_names[N_COUNTERS] = {
+	"grids_scanned",
+	"grids_accepted",
+	"conjugations",
+	"bytes_in",
+	"bytes_out",
+	"png_bytes_in",
+	"png_bytes_out"
+};
+
+
+static
+void switch_stage(const Stage stage){
+	// Attributes the time since the last switch on this thread to the stage it was in
+	const Clock now = Clock::now();
+	if (current_stage != N_STAGES){
+		stage_wall_ns[current_stage].fetch_add(now.wall_ns - stage_start.wall_ns, std::memory_order_relaxed);
+		stage_cpu_ns[current_stage].fetch_add(now.cpu_ns - stage_start.cpu_ns, std::memory_order_relaxed);
+	}
+	current_stage = stage;
+	stage_start = now;
+}
+
+void Timer::start(const Stage stage){
+	this->prev_stage = current_stage;
+	switch_stage(stage);
+}
+
+void Timer::stop(){
+	switch_stage(this->prev_stage);
+}
+
+
+void add_file_sz(const Counter counter,  const char* const fp){
+	struct stat st;
+	if (is_enabled  and  (stat(fp, &st) == 0))
+		add(counter, st.st_size);
+}
+
+
+void add_img(const int img_n,  const char* const fp,  const uint32_t w,  const uint32_t h,  const int n_bitplanes,  const int64_t capacity,  const GridCounts& grid_counts){
+	if (not is_enabled)
+		return;
+	add(GRIDS_SCANNED, grid_counts.n_scanned);
+	add(GRIDS_ACCEPTED, grid_counts.n_accepted);
+	add(CONJUGATIONS, grid_counts.n_conjugated);
+	std::unique_lock<std::mutex> lock(imgs_mutex);
+	Img& img = imgs[img_n];
+	if (img.fp.empty()  or  (capacity != -1))
+		img = Img{fp, w, h, n_bitplanes, capacity};
+}
+
+
+static
+void print(){
+	const uint64_t wall_ns = Clock::now().wall_ns - start_wall_ns;
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	const uint64_t cpu_ns = uint64_t(ts.tv_sec) * 1000000000  +  ts.tv_nsec;
+
+	const bool is_stderr = (strcmp(out_fp, "-") == 0);
+	FILE* const f = (is_stderr) ? stderr : fopen(out_fp, "w");
+	if (f == nullptr)
+		return;
+	fprintf(f, "{\n\t\"program\": ");
+	json::print_str(f, program);
+	fprintf(f, ",\n\t\"wall_ns\": %lu,\n\t\"cpu_ns\": %lu,\n\t\"stages\": {",  wall_ns,  cpu_ns);
+	for (int i = 0;  i < N_STAGES;  ++i)
+		fprintf(f,  "%s\n\t\t\"%s\": {\"wall_ns\": %lu, \"cpu_ns\": %lu}",  (i == 0) ? "" : ",",  stage_names[i],  stage_wall_ns[i].load(),  stage_cpu_ns[i].load());
+	fprintf(f, "\n\t}");
+	for (int i = 0;  i < N_COUNTERS;  ++i)
+		fprintf(f,  ",\n\t\"%s\": %lu",  counter_names[i],  counters[i].load());
+	const double wall_s = (wall_ns == 0) ? 1.0 : wall_ns / 1e9;
+	fprintf(f,  ",\n\t\"bytes_in_per_s\": %.1f,\n\t\"bytes_out_per_s\": %.1f,\n\t\"images\": [",  counters[BYTES_IN] / wall_s,  counters[BYTES_OUT] / wall_s);
+	std::unique_lock<std::mutex> lock(imgs_mutex);
+	bool is_first = true;
+	for (const auto& pair : imgs){
+		const Img& img = pair.second;
+		fprintf(f,  "%s\n\t\t{\"fp\": ",  (is_first) ? "" : ",");
+		json::print_str(f, img.fp.c_str());
+		fprintf(f,  ", \"w\": %u, \"h\": %u, \"n_bitplanes\": %d, \"capacity\": ",  img.w,  img.h,  img.n_bitplanes);
+		if (img.capacity == -1)
+			fprintf(f, "null}");
+		else
+			fprintf(f, "%ld}", img.capacity);
+		is_first = false;
+	}
+	fprintf(f, "\n\t]\n}\n");
+	if (not is_stderr)
+		fclose(f);
+}
+
+
+void enable(const char* const _program,  const char* const _out_fp){
+	program = _program;
+	out_fp = _out_fp;
+	is_enabled = true;
+	start_wall_ns = Clock::now().wall_ns;
+	atexit(print);
+}
+
+
+} // namespace stats
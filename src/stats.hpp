@@ -0,0 +1,94 @@
+#pragma once
+
+#ifdef STATS
+
+#include <atomic>
+#include <cstdint>
+
+
+/*
+ * Timings and counters of a run, which are written as JSON at exit when enabled with -T
+ * Each thread's time is attributed to the innermost stage it is in, so a stage's time excludes that of the stages within it. Stages run on several threads at once, so their times can add up to more than the run's.
+ */
+
+
+namespace stats {
+
+
+enum Stage {
+	READ_INPUT, // From stdin, or the files bpcs-fmt formats
+	DECODE, // Of vessel images, including any wait for the decoder thread
+	SPLIT, // Of pixels into CGC byteplanes, and of byteplanes into bitplanes
+	COMPLEXITIES,
+	GRIDS, // Walking the grids of the stream, extracting and embedding
+	MERGE, // Of embedded grids back into pixels
+	ENCODE, // Of output images, including any wait for the encoder thread
+	WRITE_OUTPUT, // To stdout, or the files bpcs-fmt extracts
+	N_STAGES
+};
+
+enum Counter {
+	GRIDS_SCANNED, // Whose complexity was compared with the threshold
+	GRIDS_ACCEPTED, // Extracted or embedded
+	CONJUGATIONS,
+	BYTES_IN,
+	BYTES_OUT,
+	PNG_BYTES_IN,
+	PNG_BYTES_OUT,
+	N_COUNTERS
+};
+
+struct GridCounts {
+	// Of the current image of a stream, which are counted even when stats are not enabled, as that is cheaper than checking
+	uint64_t n_scanned;
+	uint64_t n_accepted;
+	uint64_t n_conjugated;
+};
+
+
+extern bool is_enabled;
+extern std::atomic<uint64_t> counters[N_COUNTERS];
+
+
+void enable(const char* const program,  const char* const out_fp);
+// Writes the stats of the run to out_fp at exit, or to stderr if it is "-"
+
+inline
+void add(const Counter counter,  const uint64_t n){
+	if (is_enabled)
+		counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void add_file_sz(const Counter counter,  const char* const fp);
+
+void add_img(const int img_n,  const char* const fp,  const uint32_t w,  const uint32_t h,  const int n_bitplanes,  const int64_t capacity,  const GridCounts& grid_counts);
+// Records an image that a stream has finished with. capacity is -1 if unknown. An image recorded more than once, by different streams, is only listed once.
+
+
+class Timer {
+	// Attributes the time until it is destroyed to the stage, on this thread
+  public:
+	explicit
+	Timer(const Stage stage)
+	: is_timing(is_enabled)
+	{
+		if (this->is_timing)
+			this->start(stage);
+	}
+
+	~Timer(){
+		if (this->is_timing)
+			this->stop();
+	}
+  private:
+	const bool is_timing;
+	Stage prev_stage;
+
+	void start(const Stage stage);
+	void stop();
+};
+
+
+} // namespace stats
+
+#endif
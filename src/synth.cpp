@@ -0,0 +1,63 @@
+#include "synth.hpp"
+#include "grid.hpp"
+#include <vector>
+
+
+namespace synth {
+
+
+bool parse_weights(const char* str,  unsigned weights[max_noise_bits + 1]){
+	unsigned total = 0;
+	for (int i = 0;  i <= max_noise_bits;  ++i){
+		weights[i] = 0;
+		if (*str == 0)
+			continue;
+		if ((*str < '0')  or  (*str > '9'))
+			return false;
+		for (;  (*str >= '0')  and  (*str <= '9');  ++str)
+			weights[i] = 10 * weights[i]  +  (*str - '0');
+		total += weights[i];
+		if (*str == ',')
+			++str;
+		else if (*str != 0)
+			return false;
+	}
+	return (*str == 0)  and  (total != 0);
+}
+
+
+void generate(const VesselSpec& spec,  const int img_n,  uchar* pixels){
+	Rng rng{spec.seed * 0x100000001b3  +  img_n};
+
+	// The number of noise bits of each grid, including the partial grids at the edges
+	unsigned total_weight = 0;
+	for (int k = 0;  k <= max_noise_bits;  ++k)
+		total_weight += spec.weights[k];
+	const uint32_t n_grids_hrztl = (spec.w + DefaultGrid::w - 1) / DefaultGrid::w;
+	const uint32_t n_grids_vert  = (spec.h + DefaultGrid::h - 1) / DefaultGrid::h;
+	std::vector<uchar> noise_masks(n_grids_hrztl * n_grids_vert);
+	for (uchar& mask : noise_masks){
+		unsigned r = rng.next() % total_weight;
+		int k = 0;
+		while (r >= spec.weights[k])
+			r -= spec.weights[k++];
+		mask = (1 << k) - 1;
+	}
+
+	for (uint32_t y = 0;  y < spec.h;  ++y){
+		const uchar* const masks = noise_masks.data()  +  (y / DefaultGrid::h) * n_grids_hrztl;
+		const unsigned y_grad = (y * 256) / spec.h;
+		for (uint32_t x = 0;  x < spec.w;  ++x){
+			const uchar mask = masks[x / DefaultGrid::w];
+			const unsigned x_grad = (x * 256) / spec.w;
+			for (unsigned k = 0;  k < N_CHANNELS;  ++k){
+				// A different gradient in each channel, so that the channels' bitplanes differ
+				const uchar base = (x_grad * (k + 1)  +  y_grad * (N_CHANNELS - k)) / (N_CHANNELS + 1);
+				*(pixels++) = (base & ~mask)  |  (uchar(rng.next()) & mask);
+			}
+		}
+	}
+}
+
+
+} // namespace synth
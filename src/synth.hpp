@@ -0,0 +1,50 @@
+#pragma once
+
+#include "typedefs.hpp"
+
+
+/*
+ * Synthetic vessel images for bpcs-bench, generated deterministically from a seed
+ * Each grid of an image has a number of random low bits in each channel, drawn from a weighted distribution, over a smooth gradient. The bitplanes below that number are noise, so complex, and those above it are smooth, so simple. The distribution therefore controls the capacity of the images at any threshold.
+ */
+
+
+namespace synth {
+
+
+constexpr static
+const int max_noise_bits = 8;
+
+struct Rng {
+	// splitmix64
+	uint64_t state;
+
+	uint64_t next(){
+		uint64_t z = (this->state += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		return z ^ (z >> 31);
+	}
+
+	void fill(uchar* itr,  size_t n){
+		for (;  n != 0;  --n)
+			*(itr++) = uchar(this->next());
+	}
+};
+
+struct VesselSpec {
+	uint32_t w = 1024;
+	uint32_t h = 1024;
+	uint64_t seed = 1;
+	unsigned weights[max_noise_bits + 1] = {1, 1, 1, 1, 1, 1, 1, 1, 1}; // Relative number of grids with 0, 1 ... max_noise_bits random low bits
+};
+
+
+bool parse_weights(const char* str,  unsigned weights[max_noise_bits + 1]);
+// From a comma-separated list of up to (max_noise_bits + 1) integers, the rest being 0. Returns false if it is malformed, or every weight is 0.
+
+void generate(const VesselSpec& spec,  const int img_n,  uchar* pixels);
+// Writes the img_n-th image of the spec into pixels, which holds (N_CHANNELS * w * h) bytes, of 8 bits each
+
+
+} // namespace synth
@@ -0,0 +1,87 @@
+#include "trace.hpp"
+#include "json.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib> // for atexit
+#include <cstring> // for strcmp
+#include <mutex>
+#include <unistd.h> // for getpid
+
+
+namespace trace {
+
+
+bool is_enabled = false;
+
+static FILE* f;
+static std::mutex f_mutex;
+static std::chrono::steady_clock::time_point start;
+static int pid;
+static std::atomic<int> n_threads(0);
+
+static thread_local int thread_id = -1;
+static thread_local bool is_bitplane_track_named = false;
+
+constexpr static
+const int bitplane_track_offset = 1000; // Added to a thread's id to give that of its bitplane track
+
+
+uint64_t now(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+void add_event(const char* const name,  const uint64_t start_ns,  const uint64_t end_ns,  const bool is_bitplane,  const Args& args){
+	if (thread_id == -1)
+		thread_id = n_threads++;
+	int tid = thread_id;
+	std::unique_lock<std::mutex> lock(f_mutex);
+	if (is_bitplane){
+		tid += bitplane_track_offset;
+		if (not is_bitplane_track_named){
+			fprintf(f,  "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"bitplanes of %d\"}},\n",  pid,  tid,  thread_id);
+			is_bitplane_track_named = true;
+		}
+	}
+	fprintf(f,  "{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {",  name,  pid,  tid,  start_ns / 1e3,  (end_ns - start_ns) / 1e3);
+	const char* sep = "";
+	if (args.fp != nullptr){
+		fprintf(f, "\"fp\": ");
+		json::print_str(f, args.fp);
+		sep = ", ";
+	}
+	if (args.bitplane_n != -1){
+		fprintf(f, "%s\"bitplane_n\": %d", sep, args.bitplane_n);
+		sep = ", ";
+	}
+	if (args.n_bytes != -1)
+		fprintf(f, "%s\"n_bytes\": %ld", sep, args.n_bytes);
+	fprintf(f, "}},\n");
+	fflush(f);
+}
+
+
+static
+void finish(){
+	// The JSON array format allows the final bracket to be left out, but not a trailing comma
+	std::unique_lock<std::mutex> lock(f_mutex);
+	fprintf(f,  "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, \"args\": {\"name\": \"bpcs\"}}\n]\n",  pid);
+	if (f != stderr)
+		fclose(f);
+}
+
+
+void enable(const char* const out_fp){
+	f = (strcmp(out_fp, "-") == 0) ? stderr : fopen(out_fp, "w");
+	if (f == nullptr)
+		return;
+	start = std::chrono::steady_clock::now();
+	pid = getpid();
+	fprintf(f, "[\n");
+	is_enabled = true;
+	atexit(finish);
+}
+
+
+} // namespace trace
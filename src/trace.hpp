@@ -0,0 +1,60 @@
+#pragma once
+
+#ifdef TRACING
+
+#include <cstdint>
+
+
+/*
+ * Timeline of a run, written as Chrome trace events when enabled with -t, to be viewed in Perfetto or chrome://tracing
+ * Each event is written as soon as it ends, so the trace of a run that stalls or is killed can still be read.
+ * The time spent walking each bitplane is shown on a track of its own beside the thread that walked it, as it does not nest within the other events.
+ */
+
+
+namespace trace {
+
+
+struct Args {
+	// Only those that are set are written
+	const char* fp = nullptr; // Of an image
+	int bitplane_n = -1; // Indexed as (channel_n * n_bitplanes + bitplane_n)
+	int64_t n_bytes = -1;
+};
+
+
+extern bool is_enabled;
+
+
+void enable(const char* const out_fp);
+
+uint64_t now(); // Nanoseconds since the trace began
+
+void add_event(const char* const name,  const uint64_t start_ns,  const uint64_t end_ns,  const bool is_bitplane,  const Args& args);
+// is_bitplane is whether to put the event on the bitplane track of this thread
+
+
+class Span {
+	// An event lasting until it is destroyed
+  public:
+	explicit
+	Span(const char* const name,  const Args& args = Args())
+	: name((is_enabled) ? name : nullptr)
+	, args(args)
+	, start_ns((is_enabled) ? now() : 0)
+	{}
+
+	~Span(){
+		if (this->name != nullptr)
+			add_event(this->name, this->start_ns, now(), false, this->args);
+	}
+  private:
+	const char* const name;
+	const Args args;
+	const uint64_t start_ns;
+};
+
+
+} // namespace trace
+
+#endif
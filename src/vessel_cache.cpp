@@ -0,0 +1,89 @@
+#include "vessel_cache.hpp"
+#include <compsky/macros/likely.hpp>
+#include <iterator> // for std::prev
+#include <sys/stat.h>
+#ifdef CHITTY_CHATTY
+# include <cstdio>
+#endif
+
+
+bool VesselCache::get_file_id(const char* const fp,  FileId& id){
+	struct stat st;
+	if (stat(fp, &st) != 0)
+		return false;
+	id.dev = st.st_dev;
+	id.ino = st.st_ino;
+	id.sz = st.st_size;
+	id.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000  +  st.st_mtim.tv_nsec;
+	return true;
+}
+
+
+std::shared_ptr<const Vessel> VesselCache::get(const char* const fp,  const std::function<std::shared_ptr<const Vessel>()>& decode){
+	FileId id;
+	if (unlikely(not get_file_id(fp, id)))
+		// decode() reports the error
+		return decode();
+	const std::string key(fp);
+
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->decoded.wait(lock,  [&](){
+			return (this->being_decoded.count(key) == 0);
+		});
+		const auto itr = this->index.find(key);
+		if (itr != this->index.end()){
+			const std::list<Entry>::iterator entry = itr->second;
+			if (entry->id == id){
+				this->entries.splice(this->entries.begin(),  this->entries,  entry);
+			  #ifdef CHITTY_CHATTY
+				fprintf(stderr,  "Vessel cache hit: %s\n",  fp);
+			  #endif
+				return entry->vessel;
+			}
+			this->erase(entry);
+		}
+		this->being_decoded.insert(key);
+	}
+
+	struct Unmark {
+		// Wakes the workers waiting for the vessel however decoding ends, as handler() throws in the daemon
+		VesselCache* const cache;
+		const std::string& key;
+
+		~Unmark(){
+			{
+				const std::lock_guard<std::mutex> lock(this->cache->mutex);
+				this->cache->being_decoded.erase(this->key);
+			}
+			this->cache->decoded.notify_all();
+		}
+	} unmark{this, key};
+
+	const std::shared_ptr<const Vessel> vessel = decode();
+	{
+		const std::lock_guard<std::mutex> lock(this->mutex);
+		this->insert(key, id, vessel);
+	}
+	return vessel;
+}
+
+
+void VesselCache::insert(const std::string& fp,  const FileId& id,  const std::shared_ptr<const Vessel>& vessel){
+	const size_t vessel_sz = vessel->img_data.size()  +  vessel->grid_complexities.size() * sizeof(DefaultGrid::complexity_typ);
+	if (vessel_sz > this->max_sz)
+		return;
+	this->entries.push_front(Entry{fp, id, vessel, vessel_sz});
+	this->index[fp] = this->entries.begin();
+	this->sz += vessel_sz;
+	while (this->sz > this->max_sz)
+		this->erase(std::prev(this->entries.end()));
+}
+
+
+void VesselCache::erase(const std::list<Entry>::iterator itr){
+	// Jobs still using the vessel keep it alive until they finish
+	this->sz -= itr->sz;
+	this->index.erase(itr->fp);
+	this->entries.erase(itr);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "typedefs.hpp"
+#include "png.hpp" // for png_color_16
+#include "grid.hpp" // for DefaultGrid
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory> // for std::shared_ptr
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/types.h> // for dev_t, ino_t, off_t
+
+
+struct Vessel {
+	// A vessel image as BPCSStreamBuf::decode_img leaves it, which is the same whatever job it is used for
+	uint32_t w;
+	uint32_t h;
+	int n_bitplanes;
+	png_color_16 png_bg;
+	bool has_png_bg;
+	std::vector<uchar> img_data; // The pixels, then the byteplane of each channel
+	std::vector<DefaultGrid::complexity_typ> grid_complexities; // Of every grid, so whatever the minimum complexity of the job
+};
+
+
+class VesselCache {
+	/*
+	 * The most recently used vessels, up to a total size, keyed by their paths
+	 * A vessel is decoded again if its file has changed since it was cached
+	 * Shared by all of the daemon's workers
+	 */
+  public:
+	explicit
+	VesselCache(const size_t max_sz)
+	: sz(0)
+	, max_sz(max_sz)
+	{}
+
+	std::shared_ptr<const Vessel> get(const char* const fp,  const std::function<std::shared_ptr<const Vessel>()>& decode);
+	// Returns the vessel of the file, calling decode() for it if it is not cached. If another worker is already decoding it, waits for that worker rather than decoding it too.
+
+  private:
+	struct FileId {
+		// Changes whenever the file is replaced or modified
+		dev_t dev;
+		ino_t ino;
+		off_t sz;
+		int64_t mtime_ns;
+
+		bool operator==(const FileId& other) const {
+			return (this->dev == other.dev)  and  (this->ino == other.ino)  and  (this->sz == other.sz)  and  (this->mtime_ns == other.mtime_ns);
+		}
+	};
+
+	struct Entry {
+		std::string fp;
+		FileId id;
+		std::shared_ptr<const Vessel> vessel;
+		size_t sz;
+	};
+
+	std::mutex mutex;
+	std::condition_variable decoded; // Notified whenever a worker finishes decoding a vessel
+	std::list<Entry> entries; // Most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> index;
+	std::unordered_set<std::string> being_decoded;
+	size_t sz; // Of all the entries' vessels
+	const size_t max_sz;
+
+	static
+	bool get_file_id(const char* const fp,  FileId& id);
+
+	void insert(const std::string& fp,  const FileId& id,  const std::shared_ptr<const Vessel>& vessel);
+	void erase(const std::list<Entry>::iterator itr);
+};